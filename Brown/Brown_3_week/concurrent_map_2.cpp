@@ -3,6 +3,7 @@
 
 #include <future>
 #include <mutex>
+#include <shared_mutex>
 #include <unordered_map>
 #include <vector>
 #include <utility>
@@ -20,9 +21,16 @@ private:
 		return hasher(key) % concurrent_map.size();
 	}
 
-	struct ConcurrentBucket {
+	// Размер строки кеша: мьютексы соседних корзин не должны попадать
+	// в одну строку, иначе потоки, работающие с разными корзинами,
+	// всё равно мешают друг другу
+	static constexpr size_t CACHE_LINE_SIZE = 64;
+
+	// Читатели берут разделяемую блокировку и не мешают друг другу,
+	// писатели — исключительную
+	struct alignas(CACHE_LINE_SIZE) ConcurrentBucket {
 		MapType data;
-		mutable mutex m;
+		mutable shared_mutex m;
 	};
 
 	Hash hasher;
@@ -30,18 +38,34 @@ private:
 	vector<ConcurrentBucket> concurrent_map;
 
 public:
-	struct WriteAccess : lock_guard<mutex> {
+	struct WriteAccess : lock_guard<shared_mutex> {
 		V& ref_to_value;
 
 		WriteAccess(const K& key, ConcurrentBucket& bucket)
 				: lock_guard(bucket.m), ref_to_value(bucket.data[key]) {}
 	};
 
-	struct ReadAccess : lock_guard<mutex> {
+	struct ReadAccess : shared_lock<shared_mutex> {
 		const V& ref_to_value;
 
 		ReadAccess(const K& key, const ConcurrentBucket& bucket)
-				: lock_guard(bucket.m), ref_to_value(bucket.data.at(key)) {}
+				: shared_lock(bucket.m), ref_to_value(bucket.data.at(key)) {}
+	};
+
+	// Как ReadAccess, но для отсутствующего ключа хранит nullptr вместо исключения
+	struct FindAccess : shared_lock<shared_mutex> {
+		const V* ptr_to_value;
+
+		FindAccess(const K& key, const ConcurrentBucket& bucket)
+				: shared_lock(bucket.m), ptr_to_value(nullptr) {
+			if (auto it = bucket.data.find(key); it != bucket.data.end()) {
+				ptr_to_value = &it->second;
+			}
+		}
+
+		explicit operator bool() const {
+			return ptr_to_value != nullptr;
+		}
 	};
 
 	explicit ConcurrentMap(size_t bucket_count) : concurrent_map(bucket_count) {}
@@ -56,23 +80,33 @@ public:
 		return ReadAccess(key, concurrentBucket);
 	}
 
+	FindAccess Find(const K& key) const {
+		const ConcurrentBucket& concurrentBucket = concurrent_map[BucketNum(key)];
+		return FindAccess(key, concurrentBucket);
+	}
+
 	bool Has(const K& key) const {
-		try {
-			const ReadAccess& access = At(key);
-			return true;
-		} catch (exception&) {
-			return false;
-		}
+		return static_cast<bool>(Find(key));
 	}
 
-	MapType BuildOrdinaryMap() const {
-		MapType result;
+	// Обходит все пары без копирования, блокируя на чтение по одной
+	// корзине. Каждая корзина видна целиком на момент её обхода,
+	// но весь словарь — не на один момент времени.
+	template<typename Visitor>
+	void ForEach(Visitor visitor) const {
 		for (const ConcurrentBucket& b : concurrent_map) {
-			lock_guard<mutex> g(b.m);
-			for (auto&[key, value]: b.data) {
-				result[key] = value;
+			shared_lock g(b.m);
+			for (const auto&[key, value]: b.data) {
+				visitor(key, value);
 			}
 		}
+	}
+
+	MapType BuildOrdinaryMap() const {
+		MapType result;
+		ForEach([&result](const K& key, const V& value) {
+			result.emplace(key, value);
+		});
 		return result;
 	}
 };
@@ -248,6 +282,99 @@ void TestUserType() {
 	}
 }
 
+void TestFind() {
+	ConcurrentMap<int, string> cm(3);
+	cm[1].ref_to_value = "one";
+	cm[4].ref_to_value = "four";
+
+	const auto& const_map = std::as_const(cm);
+	{
+		auto access = const_map.Find(1);
+		ASSERT(access.ptr_to_value != nullptr);
+		ASSERT_EQUAL(*access.ptr_to_value, "one");
+	}
+	{
+		auto access = const_map.Find(4);
+		ASSERT(access.ptr_to_value != nullptr);
+		ASSERT_EQUAL(*access.ptr_to_value, "four");
+	}
+	ASSERT(!const_map.Find(2));
+	ASSERT(!const_map.Has(2));
+	ASSERT_EQUAL(const_map.BuildOrdinaryMap().size(), 2u);
+}
+
+void TestForEach() {
+	const size_t key_count = 20000;
+	ConcurrentMap<int, int> cm(16);
+	auto updater = [&cm, key_count] {
+		for (size_t i = 0; i < key_count; ++i) {
+			cm[i].ref_to_value++;
+		}
+	};
+	auto u1 = async(launch::async, updater);
+	auto u2 = async(launch::async, updater);
+	// Обход во время записи видит каждый ключ не больше одного раза
+	// и со значением, которое уже было записано
+	size_t seen = 0;
+	std::as_const(cm).ForEach([&seen](int, int value) {
+		ASSERT(value == 1 || value == 2);
+		++seen;
+	});
+	ASSERT(seen <= key_count);
+	u1.get();
+	u2.get();
+
+	size_t total = 0;
+	std::as_const(cm).ForEach([&total](int, int value) {
+		total += value;
+	});
+	ASSERT_EQUAL(total, 2 * key_count);
+}
+
+// Потоки поровну делят фиксированное число операций; доля чтений
+// задаётся в процентах, остальное — инкременты через operator[].
+// Половина читаемых ключей отсутствует в словаре.
+void RunMixedWorkload(ConcurrentMap<int, int>& cm, size_t thread_count, int read_percent, int key_count) {
+	const size_t op_count = 400000;
+	auto kernel = [&cm, read_percent, key_count](size_t seed, size_t ops) {
+		default_random_engine rng(seed);
+		uniform_int_distribution<int> key_dist(0, 2 * key_count - 1), percent_dist(0, 99);
+		size_t found = 0;
+		for (size_t i = 0; i < ops; ++i) {
+			const int key = key_dist(rng);
+			if (percent_dist(rng) < read_percent) {
+				found += cm.Has(key);
+			} else {
+				cm[key % key_count].ref_to_value++;
+			}
+		}
+		return found;
+	};
+
+	vector<future<size_t>> futures;
+	for (size_t i = 0; i < thread_count; ++i) {
+		futures.push_back(async(launch::async, kernel, i, op_count / thread_count));
+	}
+	for (auto& f : futures) {
+		f.get();
+	}
+}
+
+void TestContention() {
+	const int key_count = 10000;
+	for (int read_percent : {0, 50, 90, 100}) {
+		for (size_t thread_count : {1, 4, 16, 64}) {
+			ConcurrentMap<int, int> cm(64);
+			for (int key = 0; key < key_count; ++key) {
+				cm[key].ref_to_value = 0;
+			}
+
+			LOG_DURATION(to_string(read_percent) + "% reads, " + to_string(thread_count) + " threads");
+			RunMixedWorkload(cm, thread_count, read_percent, key_count);
+		}
+	}
+}
+
 void TestHas() {
 	ConcurrentMap<int, int> cm(2);
 	cm[1].ref_to_value = 100;
@@ -268,4 +395,7 @@ int main() {
 	RUN_TEST(tr, TestStringKeys);
 	RUN_TEST(tr, TestUserType);
 	RUN_TEST(tr, TestHas);
+	RUN_TEST(tr, TestFind);
+	RUN_TEST(tr, TestForEach);
+	RUN_TEST(tr, TestContention);
 }
\ No newline at end of file
@@ -2,9 +2,15 @@
 #include "../../profile.h"
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <stdexcept>
 #include <vector>
 #include <random>
 #include <future>
+#include <set>
 #include <mutex>
 
 using namespace std;
@@ -26,14 +32,24 @@ public:
 		return {lock_guard<mutex>(concurrentBucket.m), concurrentBucket.bucket[key]};
 	}
 
-	map<K, V> BuildOrdinaryMap() {
-		map<K, V> result;
+	// Обходит все пары без копирования, блокируя по одной корзине.
+	// Каждая корзина видна целиком на момент её обхода, но весь
+	// словарь — не на один момент времени.
+	template<typename Visitor>
+	void ForEach(Visitor visitor) {
 		for (ConcurrentBucket& b : concurrent_map) {
 			lock_guard<mutex> g(b.m);
-			for (auto&[key, value]: b.bucket) {
-				result[key] = value;
+			for (const auto&[key, value]: b.bucket) {
+				visitor(key, value);
 			}
 		}
+	}
+
+	map<K, V> BuildOrdinaryMap() {
+		map<K, V> result;
+		ForEach([&result](const K& key, const V& value) {
+			result.emplace(key, value);
+		});
 		return result;
 	}
 
@@ -51,8 +67,136 @@ private:
 	vector<ConcurrentBucket> concurrent_map;
 };
 
+// Словарь счётчиков без блокировок: открытая адресация с линейным
+// пробированием в таблице фиксированного размера. Ключ занимает ячейку
+// один раз через CAS и больше не меняется, а значение только
+// увеличивается через fetch_add, поэтому потоки никогда не ждут друг друга.
+// Размер задаётся при создании; если свободные ячейки кончились,
+// Add бросает length_error.
+template<typename K, typename V>
+class LockFreeMap {
+public:
+	static_assert(is_integral_v<K>, "LockFreeMap supports only integer keys");
+	static_assert(is_integral_v<V>, "LockFreeMap supports only integer values");
+
+	// Таблица вдвое больше ожидаемого числа ключей, чтобы цепочки
+	// пробирования оставались короткими
+	explicit LockFreeMap(size_t max_key_count)
+			: mask(RoundUpToPowerOfTwo(max(max_key_count * 2, size_t(2))) - 1), slots(mask + 1) {
+		for (Slot& slot : slots) {
+			slot.key.store(EMPTY_KEY, memory_order_relaxed);
+			slot.value.store(0, memory_order_relaxed);
+		}
+	}
+
+	// Возвращает значение до прибавления, как fetch_add
+	V Add(K key, V delta) {
+		return FindOrInsert(key).fetch_add(delta, memory_order_relaxed);
+	}
+
+	// Для отсутствующего ключа возвращает 0
+	V Get(K key) const {
+		if (key == EMPTY_KEY) {
+			return empty_key_value.load(memory_order_relaxed);
+		}
+		for (size_t i = Hash(key), probes = 0; probes <= mask; i = (i + 1) & mask, ++probes) {
+			const K slot_key = slots[i].key.load(memory_order_acquire);
+			if (slot_key == key) {
+				return slots[i].value.load(memory_order_relaxed);
+			}
+			if (slot_key == EMPTY_KEY) {
+				break;
+			}
+		}
+		return 0;
+	}
+
+	// Обходит все занятые ячейки без блокировок и копирования. Значения
+	// читаются по одному, так что параллельные Add могут попасть в обход
+	// частично.
+	template<typename Visitor>
+	void ForEach(Visitor visitor) const {
+		if (has_empty_key.load(memory_order_acquire)) {
+			visitor(EMPTY_KEY, empty_key_value.load(memory_order_relaxed));
+		}
+		for (const Slot& slot : slots) {
+			if (const K key = slot.key.load(memory_order_acquire); key != EMPTY_KEY) {
+				visitor(key, slot.value.load(memory_order_relaxed));
+			}
+		}
+	}
+
+	map<K, V> BuildOrdinaryMap() const {
+		map<K, V> result;
+		ForEach([&result](K key, V value) {
+			result.emplace(key, value);
+		});
+		return result;
+	}
+
+private:
+	// Ключ, отмечающий свободную ячейку. Его собственное значение
+	// хранится отдельно, так что пользоваться можно всеми ключами.
+	static constexpr K EMPTY_KEY = numeric_limits<K>::min();
+
+	struct Slot {
+		atomic<K> key;
+		atomic<V> value;
+	};
+
+	static size_t RoundUpToPowerOfTwo(size_t n) {
+		size_t result = 1;
+		while (result < n) {
+			result <<= 1;
+		}
+		return result;
+	}
+
+	// Соседние ключи разносятся по всей таблице мультипликативным хешем
+	size_t Hash(K key) const {
+		const uint64_t h = static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull;
+		return (h ^ (h >> 32)) & mask;
+	}
+
+	atomic<V>& FindOrInsert(K key) {
+		if (key == EMPTY_KEY) {
+			has_empty_key.store(true, memory_order_release);
+			return empty_key_value;
+		}
+		for (size_t i = Hash(key), probes = 0; probes <= mask; i = (i + 1) & mask, ++probes) {
+			K slot_key = slots[i].key.load(memory_order_acquire);
+			if (slot_key == EMPTY_KEY) {
+				// Проигравший CAS получает в slot_key ключ победителя
+				if (slots[i].key.compare_exchange_strong(slot_key, key, memory_order_acq_rel)) {
+					return slots[i].value;
+				}
+			}
+			if (slot_key == key) {
+				return slots[i].value;
+			}
+		}
+		throw length_error("LockFreeMap is full");
+	}
+
+	const size_t mask;
+	vector<Slot> slots;
+	atomic<bool> has_empty_key = false;
+	atomic<V> empty_key_value = 0;
+};
+
+template<typename K, typename V>
+void Increment(ConcurrentMap<K, V>& cm, K key) {
+	cm[key].ref_to_value++;
+}
+
+template<typename K, typename V>
+void Increment(LockFreeMap<K, V>& cm, K key) {
+	cm.Add(key, 1);
+}
+
+template<typename Map>
 void RunConcurrentUpdates(
-		ConcurrentMap<int, int>& cm, size_t thread_count, int key_count
+		Map& cm, size_t thread_count, int key_count
 ) {
 	auto kernel = [&cm, key_count](int seed) {
 		vector<int> updates(key_count);
@@ -61,7 +205,7 @@ void RunConcurrentUpdates(
 
 		for (int i = 0; i < 2; ++i) {
 			for (auto key : updates) {
-				cm[key].ref_to_value++;
+				Increment(cm, key);
 			}
 		}
 	};
@@ -133,9 +277,110 @@ void TestSpeedup() {
 	}
 }
 
+void TestLockFreeUpdate() {
+	const size_t thread_count = 3;
+	const size_t key_count = 50000;
+
+	LockFreeMap<int, int> cm(key_count);
+	RunConcurrentUpdates(cm, thread_count, key_count);
+
+	const auto result = cm.BuildOrdinaryMap();
+	ASSERT_EQUAL(result.size(), key_count);
+	for (auto&[k, v] : result) {
+		AssertEqual(v, 6, "Key = " + to_string(k));
+		AssertEqual(cm.Get(k), 6, "Key = " + to_string(k));
+	}
+	ASSERT_EQUAL(cm.Get(key_count), 0);
+}
+
+void TestLockFreeEdgeKeys() {
+	LockFreeMap<int64_t, uint32_t> cm(4);
+	const int64_t min_key = numeric_limits<int64_t>::min();
+	const int64_t max_key = numeric_limits<int64_t>::max();
+	ASSERT_EQUAL(cm.Get(min_key), 0u);
+	ASSERT_EQUAL(cm.Add(min_key, 5), 0u);
+	ASSERT_EQUAL(cm.Add(min_key, 1), 5u);
+	cm.Add(max_key, 2);
+	cm.Add(0, 3);
+	cm.Add(-1, 4);
+
+	const map<int64_t, uint32_t> expected = {{min_key, 6}, {-1, 4}, {0, 3}, {max_key, 2}};
+	ASSERT_EQUAL(cm.BuildOrdinaryMap(), expected);
+}
+
+void TestLockFreeFull() {
+	LockFreeMap<int, int> cm(2);
+	for (int key = 0; key < 4; ++key) {
+		cm.Add(key, 1);
+	}
+	cm.Add(3, 1);
+	try {
+		cm.Add(4, 1);
+		ASSERT(false);
+	} catch (length_error&) {
+	}
+	ASSERT_EQUAL(cm.Get(3), 2);
+}
+
+template<typename Map>
+void TestForEachWhileUpdating(Map& cm) {
+	const int key_count = 20000;
+	auto updater = async(launch::async, [&cm, key_count] {
+		RunConcurrentUpdates(cm, 2, key_count);
+	});
+	// Обход во время записи не видит ключ дважды и не видит
+	// значений больше итоговых
+	set<int> seen;
+	cm.ForEach([&seen](int key, int value) {
+		ASSERT(seen.insert(key).second);
+		ASSERT(value >= 0 && value <= 4);
+	});
+	updater.get();
+
+	int64_t total = 0;
+	cm.ForEach([&total](int, int value) {
+		total += value;
+	});
+	ASSERT_EQUAL(total, 4 * key_count);
+}
+
+void TestForEach() {
+	{
+		ConcurrentMap<int, int> cm(16);
+		TestForEachWhileUpdating(cm);
+	}
+	{
+		LockFreeMap<int, int> cm(20000);
+		TestForEachWhileUpdating(cm);
+	}
+}
+
+void TestLockFreeSpeedup() {
+	const int key_count = 20000;
+	for (size_t thread_count : {1, 4, 16, 64}) {
+		{
+			ConcurrentMap<int, int> many_locks(100);
+
+			LOG_DURATION("100 locks, " + to_string(thread_count) + " threads");
+			RunConcurrentUpdates(many_locks, thread_count, key_count);
+		}
+		{
+			LockFreeMap<int, int> lock_free(key_count);
+
+			LOG_DURATION("Lock-free, " + to_string(thread_count) + " threads");
+			RunConcurrentUpdates(lock_free, thread_count, key_count);
+		}
+	}
+}
+
 int main() {
 	TestRunner tr;
 	RUN_TEST(tr, TestConcurrentUpdate);
 	RUN_TEST(tr, TestReadAndWrite);
 	RUN_TEST(tr, TestSpeedup);
+	RUN_TEST(tr, TestLockFreeUpdate);
+	RUN_TEST(tr, TestLockFreeEdgeKeys);
+	RUN_TEST(tr, TestLockFreeFull);
+	RUN_TEST(tr, TestForEach);
+	RUN_TEST(tr, TestLockFreeSpeedup);
 }
\ No newline at end of file
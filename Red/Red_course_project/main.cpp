@@ -1,10 +1,12 @@
 #include "search_server.h"
 #include "parse.h"
 #include "../../test_runner.h"
+#include "../../profile.h"
 
 #include <vector>
 #include <string>
 #include <sstream>
+#include <random>
 
 using namespace std;
 
@@ -195,6 +197,41 @@ void TestBasicSearch() {
 	TestFunctionality(docs, queries, expected);
 }
 
+void TestIndexingSpeed() {
+	// Документы по 10000 слов из словаря в 5000 слов: прежний Add
+	// пересчитывал каждое новое слово повторным разбором всего документа
+	mt19937 rng(7);
+	uniform_int_distribution<int> word_id(0, 4999);
+	vector<string> docs(20);
+	for(auto& doc : docs) {
+		for(int i = 0; i < 10000; ++i) {
+			doc += "w" + to_string(word_id(rng)) + ' ';
+		}
+	}
+	const string first_word = docs[0].substr(0, docs[0].find(' '));
+	size_t expected_hitcount = 0;
+	for(size_t pos = 0; (pos = docs[0].find(first_word + ' ', pos)) != string::npos; pos += first_word.size()) {
+		if(pos == 0 || docs[0][pos - 1] == ' ') {
+			++expected_hitcount;
+		}
+	}
+
+	InvertedIndex index;
+	{
+		LOG_DURATION("Indexing 20 documents of 10000 words");
+		for(auto& doc : docs) {
+			index.Add(move(doc));
+		}
+	}
+	ASSERT_EQUAL(index.IndexSize(), 20u);
+	ASSERT_EQUAL(index.GetDocument(0).substr(0, first_word.size()), first_word);
+	const auto& postings = index.Lookup(first_word);
+	ASSERT(!postings.empty());
+	ASSERT_EQUAL(postings.front().first, 0u);
+	ASSERT_EQUAL(postings.front().second, expected_hitcount);
+	ASSERT(index.Lookup("missing").empty());
+}
+
 int main() {
 	TestRunner tr;
 	RUN_TEST(tr, TestSerpFormat);
@@ -202,4 +239,5 @@ int main() {
 	RUN_TEST(tr, TestHitcount);
 	RUN_TEST(tr, TestRanking);
 	RUN_TEST(tr, TestBasicSearch);
+	RUN_TEST(tr, TestIndexingSpeed);
 }
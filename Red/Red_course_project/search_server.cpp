@@ -2,18 +2,40 @@
 #include "iterator_range.h"
 
 #include <algorithm>
+#include <charconv>
 #include <iterator>
 #include <sstream>
 #include <iostream>
-
-vector<string> SplitIntoWords(const string& line) {
-	istringstream words_input(line);
-	return {istream_iterator<string>(words_input), istream_iterator<string>()};
+#include <cctype>
+
+// Делит строку по пробельным символам так же, как operator>> для string,
+// но без istringstream и копирования слов
+void SplitIntoWords(string_view line, vector<string_view>& words) {
+	words.clear();
+	size_t pos = 0;
+	while(true) {
+		while(pos < line.size() && isspace(static_cast<unsigned char>(line[pos]))) {
+			++pos;
+		}
+		if(pos == line.size()) {
+			break;
+		}
+		const size_t word_begin = pos;
+		while(pos < line.size() && !isspace(static_cast<unsigned char>(line[pos]))) {
+			++pos;
+		}
+		words.push_back(line.substr(word_begin, pos - word_begin));
+	}
 }
 
-int CountWordInLine(const string& line, const string& word) {
-	istringstream words_input(line);
-	return count(istream_iterator<string>(words_input), istream_iterator<string>(), word);
+namespace {
+	// Ответы копятся в буфере и выводятся кусками такого размера
+	const size_t OUTPUT_CHUNK_SIZE = 1 << 16;
+
+	void AppendNumber(string& out, size_t value) {
+		char buffer[24];
+		out.append(buffer, to_chars(begin(buffer), end(buffer), value).ptr);
+	}
 }
 
 SearchServer::SearchServer(istream& document_input) {
@@ -26,7 +48,7 @@ void SearchServer::UpdateDocumentBaseSingleThread(istream& document_input) {
 	InvertedIndex new_index;
 
 	for(string current_document; getline(document_input, current_document);) {
-		new_index.Add(current_document);
+		new_index.Add(move(current_document));
 	}
 
 	index = move(new_index);
@@ -44,13 +66,16 @@ void SearchServer::AddQueriesStreamSingleThread(
 ) {
 	auto indexSize = index.IndexSize();
 	vector<size_t> docid_count(indexSize);
+	vector<string_view> words;
+	string output;
+	output.reserve(2 * OUTPUT_CHUNK_SIZE);
 	for(string current_query; getline(query_input, current_query);) {
 		docid_count.assign(indexSize, 0);
 
-		vector<string> words = SplitIntoWords(current_query);
+		SplitIntoWords(current_query, words);
 
 		for(const auto& word : words) {
-			for(const auto[docid, hitcount] : index.Lookup(word)) {
+			for(const auto& [docid, hitcount] : index.Lookup(word)) {
 				docid_count[docid] += hitcount;
 			}
 		}
@@ -76,33 +101,51 @@ void SearchServer::AddQueriesStreamSingleThread(
 				}
 		);
 
-		search_results_output << current_query << ':';
+		output += current_query;
+		output += ':';
 		for(auto[docid, hitcount] : Head(search_results, 5)) {
-			search_results_output << " {"
-								  << "docid: " << docid << ", "
-								  << "hitcount: " << hitcount << '}';
+			output += " {docid: ";
+			AppendNumber(output, docid);
+			output += ", hitcount: ";
+			AppendNumber(output, hitcount);
+			output += '}';
+		}
+		output += '\n';
+		if(output.size() >= OUTPUT_CHUNK_SIZE) {
+			search_results_output.write(output.data(), output.size());
+			output.clear();
 		}
-		search_results_output << endl;
 	}
+	search_results_output.write(output.data(), output.size());
 }
 
-void InvertedIndex::Add(const string& document) {
-	docs.push_back(document);
-
+void InvertedIndex::Add(string document) {
+	docs.push_back(move(document));
 	const size_t docid = docs.size() - 1;
-	set<string> words;
-	for(const auto& word : SplitIntoWords(document)) {
-		if(words.find(word) == words.end()) {
-			words.insert(word);
-			index[word].emplace_back(docid, CountWordInLine(document, word));
+
+	// Слова документа идут подряд, поэтому повтор слова в том же
+	// документе всегда приходится на последний элемент его постингов
+	vector<string_view> words;
+	SplitIntoWords(docs.back(), words);
+	for(const auto word : words) {
+		auto it = index.find(word);
+		if(it == index.end()) {
+			it = index.emplace(string(word), vector<pair<size_t, size_t>>()).first;
+		}
+		auto& postings = it->second;
+		if(!postings.empty() && postings.back().first == docid) {
+			++postings.back().second;
+		} else {
+			postings.emplace_back(docid, 1);
 		}
 	}
 }
 
-vector<pair<size_t, size_t>> InvertedIndex::Lookup(const string& word) const {
+const vector<pair<size_t, size_t>>& InvertedIndex::Lookup(string_view word) const {
+	static const vector<pair<size_t, size_t>> empty;
 	if(auto it = index.find(word); it != index.end()) {
 		return it->second;
 	} else {
-		return {};
+		return empty;
 	}
-}
\ No newline at end of file
+}
@@ -2,18 +2,19 @@
 
 #include <istream>
 #include <ostream>
-#include <set>
 #include <vector>
 #include <map>
 #include <future>
+#include <string>
+#include <string_view>
 
 using namespace std;
 
 class InvertedIndex {
 public:
-	void Add(const string& document);
+	void Add(string document);
 
-	vector<pair<size_t, size_t>> Lookup(const string& word) const;
+	const vector<pair<size_t, size_t>>& Lookup(string_view word) const;
 
 	const string& GetDocument(size_t id) const {
 		return docs[id];
@@ -24,7 +25,7 @@ public:
 	}
 
 private:
-	map<string, vector<pair<size_t, size_t>>> index;
+	map<string, vector<pair<size_t, size_t>>, less<>> index;
 	vector<string> docs;
 };
 
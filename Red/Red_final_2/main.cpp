@@ -1,14 +1,18 @@
 #include "search_server.h"
 #include "parse.h"
 #include "test_runner.h"
+#include "profile_advanced.h"
 
 #include <algorithm>
+#include <cmath>
 #include <iterator>
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <future>
 #include <random>
 #include <thread>
 using namespace std;
@@ -201,6 +205,950 @@ void TestBasicSearch() {
   TestFunctionality(docs, queries, expected);
 }
 
+void TestUpdateWhileSearching() {
+  const string old_result = "white: {docid: 1, hitcount: 2} {docid: 0, hitcount: 1}";
+  const string new_result = "white: {docid: 0, hitcount: 1}";
+
+  istringstream old_docs("white cat\nwhite white dog");
+  istringstream new_docs("white mouse\nblack dog");
+  ostringstream queries;
+  for (int i = 0; i < 20000; ++i) {
+    queries << "white\n";
+  }
+  istringstream queries_input(queries.str());
+
+  ostringstream queries_output;
+  {
+    SearchServer srv(old_docs);
+    srv.AddQueriesStream(queries_input, queries_output);
+    srv.UpdateDocumentBase(new_docs);
+  }
+
+  const string result = queries_output.str();
+  const auto lines = SplitBy(Strip(result), '\n');
+  ASSERT_EQUAL(lines.size(), 20000u);
+  for (const auto line : lines) {
+    ASSERT(line == old_result || line == new_result);
+  }
+}
+
+string GenerateText(mt19937& rng, const vector<string>& words, size_t lines, size_t words_per_line) {
+  uniform_int_distribution<size_t> word_id(0, words.size() - 1);
+  string result;
+  for (size_t i = 0; i < lines; ++i) {
+    for (size_t j = 0; j < words_per_line; ++j) {
+      result += words[word_id(rng)];
+      result += ' ';
+    }
+    result += '\n';
+  }
+  return result;
+}
+
+void TestQueryEvaluator() {
+  mt19937 rng(7);
+  const vector<string> words = {"a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l"};
+  const string docs_text = GenerateText(rng, words, 300, 6);
+  istringstream docs_input(docs_text);
+  const InvertedIndex index(docs_input);
+  const auto docs = SplitBy(Strip(docs_text), '\n');
+
+  QueryEvaluator evaluator;
+  for (int query = 0; query < 200; ++query) {
+    const string query_text = GenerateText(rng, words, 1, 1 + query % 4);
+    const auto query_words = SplitIntoWordsView(query_text);
+
+    vector<pair<size_t, int64_t>> expected;
+    for (size_t docid = 0; docid < docs.size(); ++docid) {
+      size_t hitcount = 0;
+      for (const auto doc_word : SplitIntoWordsView(docs[docid])) {
+        hitcount += count(query_words.begin(), query_words.end(), doc_word);
+      }
+      if (hitcount > 0) {
+        expected.emplace_back(hitcount, -static_cast<int64_t>(docid));
+      }
+    }
+    sort(expected.rbegin(), expected.rend());
+    expected.resize(min<size_t>(expected.size(), 5));
+
+    const auto& top = evaluator.Evaluate(index, query_words);
+    ASSERT_EQUAL(top.size(), expected.size());
+    for (size_t i = 0; i < top.size(); ++i) {
+      ASSERT_EQUAL(top[i].hitcount, expected[i].first);
+      ASSERT_EQUAL(-static_cast<int64_t>(top[i].docid), expected[i].second);
+    }
+  }
+}
+
+void TestShardedIndexBuild() {
+  mt19937 rng(11);
+  const vector<string> words = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff", "ggggggg", "hhhhhhhh"};
+  const string docs_text = GenerateText(rng, words, 500, 7) + "\n\n  \nbb a";
+
+  istringstream serial_input(docs_text);
+  const InvertedIndex serial(serial_input, docs_text.size() + 1, 1);
+  for (size_t block_size : {1, 7, 100, 4096}) {
+    istringstream sharded_input(docs_text);
+    const InvertedIndex sharded(sharded_input, block_size, 4);
+    ASSERT_EQUAL(sharded.GetDocumentCount(), serial.GetDocumentCount());
+    for (size_t docid = 0; docid < serial.GetDocumentCount(); ++docid) {
+      ASSERT_EQUAL(sharded.GetDocument(docid), serial.GetDocument(docid));
+    }
+    ASSERT_EQUAL(sharded.GetPostingsBytes(), serial.GetPostingsBytes());
+    for (const auto& word : words) {
+      vector<pair<uint32_t, uint32_t>> expected, found;
+      serial.Lookup(word).ForEach([&expected](uint32_t docid, uint32_t hitcount) {
+        expected.emplace_back(docid, hitcount);
+      });
+      sharded.Lookup(word).ForEach([&found](uint32_t docid, uint32_t hitcount) {
+        found.emplace_back(docid, hitcount);
+      });
+      ASSERT(found == expected);
+    }
+  }
+  ASSERT_EQUAL(serial.GetDocumentCount(), 504u);
+}
+
+vector<pair<uint32_t, uint32_t>> CollectPostings(const InvertedIndex& index, string_view word) {
+  vector<pair<uint32_t, uint32_t>> result;
+  index.Lookup(word).ForEach([&result](uint32_t docid, uint32_t hitcount) {
+    result.emplace_back(docid, hitcount);
+  });
+  return result;
+}
+
+void TestIndexSegment() {
+  mt19937 rng(17);
+  const vector<string> words = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff", "ggggggg", "hhhhhhhh"};
+  const string docs_text = GenerateText(rng, words, 300, 6) + "\n  \nbb a";
+  const string path = "search_server_test.segment";
+
+  istringstream docs_input(docs_text);
+  const InvertedIndex built(docs_input);
+  for (bool store_documents : {true, false}) {
+    built.Save(path, store_documents);
+    const InvertedIndex opened = InvertedIndex::Open(path);
+    ASSERT_EQUAL(opened.HasDocuments(), store_documents);
+    ASSERT_EQUAL(opened.GetDocumentCount(), built.GetDocumentCount());
+    ASSERT_EQUAL(opened.GetPostingsBytes(), built.GetPostingsBytes());
+    for (size_t docid = 0; docid < built.GetDocumentCount(); ++docid) {
+      ASSERT_EQUAL(opened.GetDocument(docid), store_documents ? built.GetDocument(docid) : "");
+    }
+    for (const auto& word : words) {
+      ASSERT(CollectPostings(opened, word) == CollectPostings(built, word));
+    }
+    ASSERT_EQUAL(opened.Lookup("missing").size(), 0u);
+  }
+
+  istringstream query_only_input(docs_text);
+  const InvertedIndex query_only(query_only_input, 1 << 22, 1, false);
+  ASSERT(!query_only.HasDocuments());
+  ASSERT(CollectPostings(query_only, "bb") == CollectPostings(built, "bb"));
+
+  InvertedIndex().Save(path);
+  ASSERT_EQUAL(InvertedIndex::Open(path).GetDocumentCount(), 0u);
+
+  // Сервер, поднятый из файла, отвечает так же, как построивший индекс
+  const string queries_text = GenerateText(rng, words, 200, 3);
+  istringstream original_docs(docs_text), original_queries(queries_text), restored_queries(queries_text);
+  ostringstream original_output, restored_output;
+  {
+    SearchServer original(original_docs);
+    original.SaveIndex(path);
+    original.AddQueriesStream(original_queries, original_output);
+  }
+  {
+    SearchServer restored;
+    restored.LoadIndex(path);
+    restored.AddQueriesStream(restored_queries, restored_output);
+  }
+  ASSERT_EQUAL(restored_output.str(), original_output.str());
+
+  {
+    ofstream truncated(path, ios::binary | ios::trunc);
+    truncated << "SRVSEG01";
+  }
+  try {
+    InvertedIndex::Open(path);
+    ASSERT(false);
+  } catch (const runtime_error&) {
+  }
+  remove(path.c_str());
+}
+
+// Запросы обрабатываются асинхронно, поэтому результат готов,
+// только когда сервер разрушен
+string SearchAll(unique_ptr<SearchServer> server, const string& queries_text) {
+  istringstream queries(queries_text);
+  ostringstream output;
+  server->AddQueriesStream(queries, output);
+  server.reset();
+  return output.str();
+}
+
+void TestIncrementalUpdates() {
+  mt19937 rng(23);
+  const vector<string> words = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff"};
+  const string queries_text = GenerateText(rng, words, 100, 2);
+  const string path = "search_server_test.segment";
+  vector<string> lines;
+  auto add_lines = [&lines, &rng, &words](size_t count) {
+    string text = GenerateText(rng, words, count, 4);
+    istringstream text_input(text);
+    for (string line; getline(text_input, line); ) {
+      lines.push_back(line);
+    }
+    return text;
+  };
+  // Удалённый документ равносилен пустой строке с тем же номером
+  auto expected_server = [&lines] {
+    string expected_text;
+    for (const auto& line : lines) {
+      expected_text += line + '\n';
+    }
+    istringstream expected_input(expected_text);
+    return make_unique<SearchServer>(expected_input);
+  };
+
+  istringstream initial(add_lines(200));
+  auto server = make_unique<SearchServer>(initial);
+  uniform_int_distribution<size_t> chunk_size(1, 20);
+  for (int update = 0; update < 60; ++update) {
+    const size_t expected_first_docid = lines.size();
+    istringstream chunk(add_lines(chunk_size(rng)));
+    ASSERT_EQUAL(server->AddDocuments(chunk), expected_first_docid);
+
+    uniform_int_distribution<uint32_t> docid(0, lines.size() - 1);
+    for (int i = 0; i < 3; ++i) {
+      const uint32_t deleted = docid(rng);
+      server->DeleteDocument(deleted);
+      lines[deleted].clear();
+    }
+
+    if (update % 10 == 9) {
+      server->SaveIndex(path);
+      auto restored = make_unique<SearchServer>();
+      restored->LoadIndex(path);
+      ASSERT_EQUAL(SearchAll(move(restored), queries_text), SearchAll(expected_server(), queries_text));
+    }
+  }
+  ASSERT_EQUAL(SearchAll(move(server), queries_text), SearchAll(expected_server(), queries_text));
+  remove(path.c_str());
+}
+
+// Поток, чтение из которого заканчивается ошибкой
+class FailingBuffer : public streambuf {
+protected:
+  int_type underflow() override {
+    throw runtime_error("read failed");
+  }
+};
+
+void TestBackgroundUpdates() {
+  // Сегменты дописываются, пока идёт слияние: каждый раз, когда фоновые
+  // задачи закончены, сливать должно быть нечего
+  {
+    SearchServer server;
+    for (int round = 0; round < 100; ++round) {
+      for (int i = 0; i < 5; ++i) {
+        istringstream document("a bb\n");
+        server.AddDocuments(document);
+      }
+      server.Wait();
+      ASSERT(server.GetSegmentCount() < SegmentedIndex::MERGE_FACTOR);
+    }
+  }
+
+  // Документы, дописанные после UpdateDocumentBase, продолжают новую
+  // базу и не пропадают, когда она публикуется
+  {
+    mt19937 rng(38);
+    istringstream base(GenerateText(rng, {"a", "bb", "ccc"}, 20000, 4));
+    auto server = make_unique<SearchServer>();
+    server->UpdateDocumentBase(base);
+    istringstream extra("zzz\n");
+    ASSERT_EQUAL(server->AddDocuments(extra), 20000u);
+    server->DeleteDocument(0);
+    ASSERT_EQUAL(SearchAll(move(server), "zzz\n"), "zzz: {docid: 20000, hitcount: 1}\n");
+  }
+
+  // Ошибка перестройки не теряется, а сервер остаётся рабочим
+  {
+    FailingBuffer failing_buffer;
+    istream failing_input(&failing_buffer);
+    failing_input.exceptions(ios::badbit);
+    auto server = make_unique<SearchServer>();
+    server->UpdateDocumentBase(failing_input);
+    try {
+      server->Wait();
+      ASSERT(false);
+    } catch (runtime_error& error) {
+      ASSERT_EQUAL(string(error.what()), "read failed");
+    }
+    istringstream document("a\n");
+    ASSERT_EQUAL(server->AddDocuments(document), 0u);
+    ASSERT_EQUAL(SearchAll(move(server), "a\n"), "a: {docid: 0, hitcount: 1}\n");
+  }
+}
+
+void TestSegmentMerge() {
+  mt19937 rng(29);
+  const vector<string> words = {"a", "bb", "ccc", "dddd"};
+  string all_text;
+  SegmentedIndex index;
+  for (int i = 0; i < 40; ++i) {
+    const string text = GenerateText(rng, words, 1 + i % 5, 3);
+    all_text += text;
+    istringstream text_input(text);
+    index = index.Append(InvertedIndex(text_input));
+    index = index.Delete(index.GetDocumentCount() / 2);
+    while (auto range = index.PickMerge()) {
+      index = index.ReplaceWithMerged(range->first, range->second, index.Merge(range->first, range->second));
+    }
+    ASSERT(index.GetSegments().size() < 2 * SegmentedIndex::MERGE_FACTOR);
+  }
+
+  istringstream all_input(all_text);
+  const InvertedIndex whole(all_input);
+  ASSERT_EQUAL(index.GetDocumentCount(), whole.GetDocumentCount());
+  size_t deleted_count = 0;
+  for (uint32_t docid = 0; docid < whole.GetDocumentCount(); ++docid) {
+    if (index.GetDocument(docid).empty()) {
+      ++deleted_count;
+    } else {
+      ASSERT_EQUAL(index.GetDocument(docid), whole.GetDocument(docid));
+    }
+  }
+  ASSERT(deleted_count > 0);
+
+  const InvertedIndex merged = index.Merge(0, index.GetSegments().size());
+  QueryEvaluator evaluator;
+  for (const auto& word : words) {
+    const vector<string_view> query = {word};
+    const auto segmented_top = evaluator.Evaluate(index, query);
+    const auto& merged_top = evaluator.Evaluate(merged, query);
+    ASSERT_EQUAL(segmented_top.size(), merged_top.size());
+    for (size_t i = 0; i < merged_top.size(); ++i) {
+      ASSERT_EQUAL(segmented_top[i].docid, merged_top[i].docid);
+      ASSERT_EQUAL(segmented_top[i].hitcount, merged_top[i].hitcount);
+    }
+  }
+}
+
+void TestQueryCache() {
+  {
+    QueryCache cache(2, 1);
+    cache.Put("a ", " {docid: 0, hitcount: 1}", 1);
+    cache.Put("b ", " {docid: 1, hitcount: 1}", 1);
+    ASSERT_EQUAL(cache.Get("a ", 1).value_or(""), " {docid: 0, hitcount: 1}");
+    cache.Put("c ", "", 1);
+    ASSERT(!cache.Get("b ", 1).has_value());
+    ASSERT(cache.Get("c ", 1).has_value());
+    ASSERT(!cache.Get("a ", 2).has_value());
+    const auto stats = cache.GetStats();
+    ASSERT_EQUAL(stats.hits, 2u);
+    ASSERT_EQUAL(stats.misses, 2u);
+    ASSERT_EQUAL(stats.HitRate(), 0.5);
+  }
+
+  const string docs = "white cat\nwhite white dog\nblack dog dog\ncat and dog\n";
+  const string queries_text = "white dog\ndog white\ndog  white dog\ndog dog white\ncat\nwhite dog\n";
+  for (const auto ranking : {Ranking::HitCount, Ranking::Bm25}) {
+    istringstream cached_input(docs), uncached_input(docs);
+    ASSERT_EQUAL(
+      SearchAll(make_unique<SearchServer>(cached_input, ranking), queries_text),
+      SearchAll(make_unique<SearchServer>(uncached_input, ranking, 0), queries_text)
+    );
+  }
+
+  // Ответы, закешированные до удаления документа, больше не выдаются
+  istringstream docs_input(docs);
+  SearchServer server(docs_input);
+  auto search = [&server](const string& queries_text) {
+    istringstream queries(queries_text);
+    ostringstream output;
+    server.AddQueriesStream(queries, output);
+    server.Wait();
+    return output.str();
+  };
+  ASSERT_EQUAL(search("white dog\n"), "white dog: {docid: 1, hitcount: 3} {docid: 2, hitcount: 2} "
+                                       "{docid: 0, hitcount: 1} {docid: 3, hitcount: 1}\n");
+  ASSERT_EQUAL(search("dog white\n"), "dog white: {docid: 1, hitcount: 3} {docid: 2, hitcount: 2} "
+                                       "{docid: 0, hitcount: 1} {docid: 3, hitcount: 1}\n");
+  ASSERT_EQUAL(server.GetCacheStats().hits, 1u);
+  server.DeleteDocument(1);
+  ASSERT_EQUAL(search("white dog\n"), "white dog: {docid: 2, hitcount: 2} "
+                                       "{docid: 0, hitcount: 1} {docid: 3, hitcount: 1}\n");
+  ASSERT_EQUAL(server.GetCacheStats().hits, 1u);
+}
+
+void TestLatencyHistograms() {
+  LatencyHistogram histogram;
+  for (int ns = 1; ns <= 10000; ++ns) {
+    histogram.Record(nanoseconds(ns));
+  }
+  ASSERT_EQUAL(histogram.GetCount(), 10000u);
+  for (const auto& [quantile, expected] : {pair{0.5, 5000.0}, {0.99, 9900.0}, {0.999, 9990.0}, {1.0, 10000.0}}) {
+    const double value = histogram.Percentile(quantile).count();
+    ASSERT(value >= expected && value <= expected * (1 + 1.0 / LatencyHistogram::SUB_BUCKETS));
+  }
+  ASSERT_EQUAL(histogram.Max().count(), histogram.Percentile(1.0).count());
+  for (uint64_t ns : {0ull, 31ull, 32ull, 1000ull, 123456789ull, ~0ull}) {
+    const size_t bucket = LatencyHistogram::BucketOf(ns);
+    ASSERT(bucket < LatencyHistogram::BUCKET_COUNT);
+    ASSERT(LatencyHistogram::BucketLimit(bucket) >= ns);
+    ASSERT(bucket == 0 || LatencyHistogram::BucketLimit(bucket - 1) < ns);
+  }
+
+  istringstream docs_input("white cat\nwhite white dog\nblack dog dog\n");
+  SearchServer server(docs_input);
+  istringstream queries("white dog\ndog white\ncat\n");
+  ostringstream output;
+  server.AddQueriesStream(queries, output);
+  server.Wait();
+  const size_t expected_count = LATENCY_HISTOGRAMS ? 3 : 0;
+  ASSERT_EQUAL(server.GetStageLatency(QueryStage::Split).GetCount(), expected_count);
+  ASSERT_EQUAL(server.GetStageLatency(QueryStage::Lookup).GetCount(), expected_count);
+  // Для закешированного ответа сортировки нет
+  ASSERT_EQUAL(server.GetStageLatency(QueryStage::Sort).GetCount(), LATENCY_HISTOGRAMS ? 2u : 0u);
+  ASSERT_EQUAL(server.GetStageLatency(QueryStage::Output).GetCount(), expected_count);
+
+  ostringstream json;
+  server.WriteLatencyJson(json);
+  for (const auto& stage : {"\"split\": {", "\"lookup\": {", "\"sort\": {", "\"output\": {"}) {
+    ASSERT(json.str().find(stage) != string::npos);
+  }
+  ASSERT(json.str().find("\"p999_ns\": ") != string::npos);
+}
+
+void TestPositionalIndex() {
+  {
+    Query query;
+    ParseQuery("london \"great britain\" tea \"\" \"big ben\" \"solo\" \"open end", query);
+    ASSERT((query.words == vector<string_view>{"london", "tea", "solo"}));
+    ASSERT((query.phrases == vector<vector<string_view>>{{"great", "britain"}, {"big", "ben"}, {"open", "end"}}));
+    ParseQuery("no phrases here", query);
+    ASSERT((query.words == vector<string_view>{"no", "phrases", "here"}));
+    ASSERT(query.phrases.empty());
+    ParseQuery("\"x y\" \"z\" w", query);
+    ASSERT((query.words == vector<string_view>{"w", "z"}));
+    ASSERT((query.phrases == vector<vector<string_view>>{{"x", "y"}}));
+    ParseQuery("london \"great britain\"", query, false);
+    ASSERT((query.words == vector<string_view>{"london", "\"great", "britain\""}));
+    ASSERT(query.phrases.empty());
+  }
+
+  mt19937 rng(41);
+  const vector<string> words = {"a", "b", "c", "d", "e", "f"};
+  const string docs_text = GenerateText(rng, words, 400, 12);
+  vector<vector<string_view>> docs;
+  for (const auto line : SplitBy(docs_text, '\n')) {
+    docs.push_back(SplitIntoWordsView(line));
+  }
+  istringstream docs_input(docs_text);
+  const InvertedIndex index(docs_input, 1 << 10, 4, true, true);
+  ASSERT(index.HasPositions());
+
+  // Позиции, прочитанные вслед за курсором, совпадают с номерами слов
+  for (const auto& word : words) {
+    PostingsCursor cursor(index.Lookup(word));
+    PositionsReader reader(index.LookupPositions(word));
+    for (uint32_t docid = 0; docid < docs.size(); docid += 1 + docid % 3) {
+      cursor.NextGEQ(docid);
+      if (cursor.Docid() == PostingsCursor::END) {
+        break;
+      }
+      vector<uint32_t> expected;
+      for (uint32_t position = 0; position < docs[cursor.Docid()].size(); ++position) {
+        if (docs[cursor.Docid()][position] == word) {
+          expected.push_back(position);
+        }
+      }
+      ASSERT(reader.Read(cursor) == expected);
+      docid = cursor.Docid();
+    }
+  }
+
+  auto phrase_count = [&docs](uint32_t docid, const vector<string_view>& phrase) {
+    const auto& doc = docs[docid];
+    size_t count = 0;
+    for (size_t start = 0; start + phrase.size() <= doc.size(); ++start) {
+      count += equal(phrase.begin(), phrase.end(), doc.begin() + start);
+    }
+    return count;
+  };
+
+  const string path = "search_server_test.segment";
+  SegmentedIndex segmented;
+  for (size_t first = 0; first < docs.size(); first += 70) {
+    string chunk;
+    for (size_t docid = first; docid < min(docs.size(), first + 70); ++docid) {
+      chunk += Join(' ', docs[docid]) + '\n';
+    }
+    istringstream chunk_input(chunk);
+    segmented = segmented.Append(InvertedIndex(chunk_input, 1 << 22, 1, true, true));
+  }
+  segmented = segmented.Delete(7);
+  const InvertedIndex merged = segmented.Merge(0, segmented.GetSegments().size());
+  ASSERT(merged.HasPositions());
+  merged.Save(path);
+  const InvertedIndex opened = InvertedIndex::Open(path);
+  ASSERT(opened.HasPositions());
+
+  QueryEvaluator evaluator;
+  for (const auto& phrase : vector<vector<string_view>>{{"a", "b"}, {"c", "c"}, {"d", "e", "f"}}) {
+    Query query;
+    query.phrases = {phrase};
+    vector<SearchResult> expected;
+    for (uint32_t docid = 0; docid < docs.size(); ++docid) {
+      if (const size_t count = phrase_count(docid, phrase); count != 0 && docid != 7) {
+        expected.push_back({docid, count});
+      }
+    }
+    sort(expected.begin(), expected.end(), [](const SearchResult& lhs, const SearchResult& rhs) {
+      return pair(rhs.hitcount, lhs.docid) < pair(lhs.hitcount, rhs.docid);
+    });
+    expected.resize(min<size_t>(expected.size(), 5));
+    for (const auto& top : {evaluator.Evaluate(segmented, query), evaluator.Evaluate(merged, query),
+                            evaluator.Evaluate(opened, query)}) {
+      ASSERT_EQUAL(top.size(), expected.size());
+      for (size_t i = 0; i < top.size(); ++i) {
+        ASSERT_EQUAL(top[i].docid, expected[i].docid);
+        ASSERT_EQUAL(top[i].hitcount, expected[i].hitcount);
+      }
+    }
+  }
+  remove(path.c_str());
+
+  // Без позиций слова фразы ищутся порознь
+  istringstream plain_input(docs_text);
+  const InvertedIndex plain(plain_input);
+  Query phrase_query;
+  ParseQuery("\"a b\" c", phrase_query);
+  const auto phrase_top = evaluator.Evaluate(plain, phrase_query);
+  const auto& words_top = evaluator.Evaluate(plain, vector<string_view>{"c", "a", "b"});
+  ASSERT_EQUAL(phrase_top.size(), words_top.size());
+  for (size_t i = 0; i < words_top.size(); ++i) {
+    ASSERT_EQUAL(phrase_top[i].docid, words_top[i].docid);
+  }
+
+  const string britain_docs =
+    "britain has great weather\n"
+    "great britain is an island\n"
+    "the great wall is not in britain\n";
+  istringstream britain_input(britain_docs), britain_queries("\"great britain\"\nbritain great\n");
+  ostringstream britain_output;
+  {
+    SearchServer server(britain_input, Ranking::HitCount, SearchServer::DEFAULT_CACHE_CAPACITY, true);
+    server.AddQueriesStream(britain_queries, britain_output);
+  }
+  ASSERT_EQUAL(
+    britain_output.str(),
+    "\"great britain\": {docid: 1, hitcount: 1}\n"
+    "britain great: {docid: 0, hitcount: 2} {docid: 1, hitcount: 2} {docid: 2, hitcount: 2}\n"
+  );
+
+  // Сервер без позиций разбирает запросы по-прежнему: кавычки входят в слова
+  istringstream plain_britain_input(britain_docs), plain_britain_queries("\"great britain\"\n\"great\n");
+  ostringstream plain_britain_output;
+  {
+    SearchServer server(plain_britain_input);
+    server.AddQueriesStream(plain_britain_queries, plain_britain_output);
+  }
+  ASSERT_EQUAL(plain_britain_output.str(), "\"great britain\":\n\"great:\n");
+
+  // При равных BM25 выше документ, где слова запроса стоят рядом
+  const string proximity_docs = "apple x x x x x x pie\napple pie x x x x x x\n";
+  for (const bool store_positions : {false, true}) {
+    istringstream proximity_input(proximity_docs), proximity_queries("apple pie\n");
+    ostringstream proximity_output;
+    {
+      SearchServer server(proximity_input, Ranking::Bm25, 0, store_positions);
+      server.AddQueriesStream(proximity_queries, proximity_output);
+    }
+    const string first_result = string(SplitBy(proximity_output.str(), '{')[1]);
+    ASSERT_EQUAL(first_result.substr(0, 8), store_positions ? "docid: 1" : "docid: 0");
+  }
+}
+
+void TestParallelScoring() {
+  mt19937 rng(47);
+  const vector<string> words = {"a", "bb", "ccc", "dddd", "eeeee"};
+  SegmentedIndex index;
+  for (size_t size : {12000, 6000, 2000, 500}) {
+    istringstream text_input(GenerateText(rng, words, size, 12));
+    index = index.Append(InvertedIndex(text_input));
+  }
+  uniform_int_distribution<uint32_t> any_docid(0, index.GetDocumentCount() - 1);
+  for (int i = 0; i < 500; ++i) {
+    index = index.Delete(any_docid(rng));
+  }
+
+  // Параллельный подсчёт складывает вклады слов в том же порядке,
+  // поэтому совпадают не только документы, но и оценки
+  ThreadPool pool(4);
+  QueryEvaluator sequential({}, false), parallel({}, false), parallel_pruning;
+  parallel.SetThreadPool(&pool);
+  parallel_pruning.SetThreadPool(&pool);
+  // Помощники берутся только из свободных потоков пула
+  auto wait_idle = [&pool] {
+    while (pool.IdleCount() < pool.Size()) {
+      this_thread::yield();
+    }
+  };
+  auto check = [&](QueryEvaluator& evaluator, const vector<string_view>& query, Ranking ranking) {
+    const auto expected = sequential.Evaluate(index, query, ranking);
+    const auto& found = evaluator.Evaluate(index, query, ranking);
+    ASSERT_EQUAL(found.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      ASSERT_EQUAL(found[i].docid, expected[i].docid);
+      ASSERT_EQUAL(found[i].hitcount, expected[i].hitcount);
+      ASSERT_EQUAL(found[i].score, expected[i].score);
+    }
+  };
+  const vector<vector<string_view>> queries = {{"a"}, {"a", "bb", "ccc", "dddd"}, {"ccc", "a", "dddd", "a", "eeeee"}, {"eeeee", "bb", "missing", "a", "ccc"}};
+  for (const auto& query : queries) {
+    for (Ranking ranking : {Ranking::HitCount, Ranking::Bm25}) {
+      for (QueryEvaluator* evaluator : {&parallel, &parallel_pruning}) {
+        wait_idle();
+        check(*evaluator, query, ranking);
+      }
+    }
+  }
+
+  // Когда все потоки пула заняты, запрос считается в вызывающем потоке
+  promise<void> release;
+  shared_future<void> released = release.get_future().share();
+  for (size_t i = 0; i < pool.Size(); ++i) {
+    pool.Submit([released] {
+      released.wait();
+    });
+  }
+  for (Ranking ranking : {Ranking::HitCount, Ranking::Bm25}) {
+    check(parallel_pruning, queries[1], ranking);
+  }
+  release.set_value();
+}
+
+void TestParallelQuerySpeed() {
+  mt19937 rng(48);
+  vector<string> words(64);
+  for (size_t i = 0; i < words.size(); ++i) {
+    words[i] = "w" + to_string(i);
+  }
+  istringstream docs_input(GenerateText(rng, words, 100000, 20));
+  const SegmentedIndex index = SegmentedIndex().Append(InvertedIndex(docs_input));
+  const vector<string_view> query = {"w1", "w2", "w3", "w4", "w5", "w6", "w7", "w8"};
+
+  ThreadPool pool;
+  QueryEvaluator sequential, parallel;
+  parallel.SetThreadPool(&pool);
+  const int repeats = 20;
+  for (Ranking ranking : {Ranking::HitCount, Ranking::Bm25}) {
+    steady_clock::duration sequential_time{}, parallel_time{};
+    for (int i = 0; i < repeats; ++i) {
+      {
+        ADD_DURATION(sequential_time);
+        sequential.Evaluate(index, query, ranking);
+      }
+      while (pool.IdleCount() < pool.Size()) {
+        this_thread::yield();
+      }
+      {
+        ADD_DURATION(parallel_time);
+        parallel.Evaluate(index, query, ranking);
+      }
+      const auto expected = sequential.Evaluate(index, query, ranking);
+      const auto& found = parallel.Evaluate(index, query, ranking);
+      ASSERT_EQUAL(found.size(), expected.size());
+      for (size_t j = 0; j < expected.size(); ++j) {
+        ASSERT_EQUAL(found[j].docid, expected[j].docid);
+      }
+    }
+    cerr << "  Long " << (ranking == Ranking::HitCount ? "hitcount" : "BM25") << " query: "
+         << duration_cast<microseconds>(sequential_time).count() / repeats << " us in one thread, "
+         << duration_cast<microseconds>(parallel_time).count() / repeats << " us with " << pool.Size() << " pool threads" << endl;
+  }
+}
+
+void TestLargeQueryStream() {
+  mt19937 rng(5);
+  const vector<string> words = {"a", "b", "c", "d", "e", "f", "g", "h"};
+  const string docs_text = GenerateText(rng, words, 50, 5);
+  const string queries_text = GenerateText(rng, words, 3000, 2);
+
+  istringstream index_input(docs_text);
+  const InvertedIndex index(index_input);
+  QueryEvaluator evaluator;
+  vector<string> expected;
+  for (const auto query : SplitBy(queries_text, '\n')) {
+    ostringstream line;
+    line << query << ':';
+    for (const auto& result : evaluator.Evaluate(index, SplitIntoWordsView(query))) {
+      line << " {docid: " << result.docid << ", hitcount: " << result.hitcount << '}';
+    }
+    expected.push_back(line.str());
+  }
+
+  istringstream docs_input(docs_text);
+  istringstream queries_input(queries_text);
+  ostringstream queries_output;
+  {
+    SearchServer srv(docs_input);
+    srv.AddQueriesStream(queries_input, queries_output);
+  }
+  const string result = queries_output.str();
+  const auto lines = SplitBy(result, '\n');
+  ASSERT_EQUAL(lines.size(), expected.size());
+  for (size_t i = 0; i < lines.size(); ++i) {
+    ASSERT_EQUAL(lines[i], expected[i]);
+  }
+}
+
+void TestIndexSpeed() {
+  mt19937 rng(42);
+  uniform_int_distribution<int> letter('a', 'z'), word_len(3, 10);
+  vector<string> words(10000);
+  for (auto& word : words) {
+    word.resize(word_len(rng));
+    for (auto& c : word) {
+      c = letter(rng);
+    }
+  }
+  istringstream docs_input(GenerateText(rng, words, 10000, 100));
+  const string queries = GenerateText(rng, words, 10000, 10);
+
+  TotalDuration build("  Index build");
+  TotalDuration lookup("  Lookup");
+  InvertedIndex index;
+  {
+    ADD_DURATION(build);
+    index = InvertedIndex(docs_input);
+  }
+  size_t postings_count = 0, hit_count = 0;
+  {
+    ADD_DURATION(lookup);
+    for (string_view word : SplitIntoWordsView(queries)) {
+      const auto docids = index.Lookup(word);
+      postings_count += docids.size();
+      docids.ForEach([&hit_count](uint32_t, uint32_t hits) {
+        hit_count += hits;
+      });
+    }
+  }
+  ASSERT(hit_count >= postings_count);
+  ASSERT_EQUAL(index.Lookup("#").size(), 0u);
+
+  size_t index_postings = 0;
+  for (const auto& word : words) {
+    index_postings += index.Lookup(word).size();
+  }
+  cerr << "  Postings: " << index.GetPostingsBytes() << " bytes for " << index_postings << " entries" << endl;
+  ASSERT(index.GetPostingsBytes() < index_postings * sizeof(InvertedIndex::Entry));
+}
+
+void TestPostingsCodec() {
+  const vector<InvertedIndex::Entry> docids = {
+    {0, 1}, {1, 255}, {256, 256}, {65792, 65536}, {16843008, 16777216}, {4294967295u, 4294967295u}, {4294967295u, 7}
+  };
+  for (size_t count = 0; count <= docids.size(); ++count) {
+    const vector<InvertedIndex::Entry> expected(docids.begin(), docids.begin() + count);
+    vector<uint8_t> encoded;
+    EncodePostings(expected, encoded);
+
+    vector<pair<uint32_t, uint32_t>> decoded;
+    PostingsView(encoded.data(), count).ForEach([&decoded](uint32_t docid, uint32_t hitcount) {
+      decoded.emplace_back(docid, hitcount);
+    });
+    ASSERT_EQUAL(decoded.size(), count);
+    for (size_t i = 0; i < count; ++i) {
+      ASSERT_EQUAL(decoded[i].first, expected[i].docid);
+      ASSERT_EQUAL(decoded[i].second, expected[i].hitcount);
+    }
+  }
+}
+
+void TestBm25Ranking() {
+  for (uint32_t length : {0u, 1u, 15u, 16u, 17u, 100u, 1000u, 123456u, 4294967295u}) {
+    const uint32_t decoded = DecodeDocumentLength(EncodeDocumentLength(length));
+    ASSERT(decoded <= length);
+    ASSERT(length - decoded <= (length < 16 ? 0 : length / 8));
+  }
+
+  mt19937 rng(37);
+  const vector<string> words = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff", "ggggggg"};
+  vector<string> docs;
+  string docs_text;
+  for (int i = 0; i < 200; ++i) {
+    docs.push_back(GenerateText(rng, words, 1, 1 + i % 12));
+    docs.back().pop_back();
+    docs_text += docs.back() + '\n';
+  }
+
+  // Эталон по определению BM25 с точными длинами документов
+  const Bm25Params params;
+  double total_length = 0;
+  vector<map<string_view, int>> doc_tf(docs.size());
+  map<string_view, int> doc_freq;
+  for (size_t docid = 0; docid < docs.size(); ++docid) {
+    for (const auto word : SplitIntoWordsView(docs[docid])) {
+      doc_freq[word] += doc_tf[docid][word]++ == 0;
+      ++total_length;
+    }
+  }
+  const double average_length = total_length / docs.size();
+
+  istringstream whole_input(docs_text);
+  const InvertedIndex whole(whole_input);
+  SegmentedIndex segmented;
+  for (size_t first = 0; first < docs.size(); first += 70) {
+    string part;
+    for (size_t docid = first; docid < min(first + 70, docs.size()); ++docid) {
+      part += docs[docid] + '\n';
+    }
+    istringstream part_input(part);
+    segmented = segmented.Append(InvertedIndex(part_input));
+  }
+
+  QueryEvaluator evaluator(params);
+  for (int query = 0; query < 50; ++query) {
+    const string query_text = GenerateText(rng, words, 1, 1 + query % 3);
+    const auto query_words = SplitIntoWordsView(query_text);
+
+    vector<pair<double, int64_t>> expected;
+    for (size_t docid = 0; docid < docs.size(); ++docid) {
+      double score = 0;
+      const double doc_length = SplitIntoWordsView(docs[docid]).size();
+      for (const auto word : query_words) {
+        if (const auto it = doc_tf[docid].find(word); it != doc_tf[docid].end()) {
+          const double df = doc_freq[word], tf = it->second;
+          const double idf = log(1 + (docs.size() - df + 0.5) / (df + 0.5));
+          const double norm = params.k1 * (1 - params.b + params.b * doc_length / average_length);
+          score += idf * tf * (params.k1 + 1) / (tf + norm);
+        }
+      }
+      if (score > 0) {
+        expected.emplace_back(score, -static_cast<int64_t>(docid));
+      }
+    }
+    sort(expected.rbegin(), expected.rend());
+    expected.resize(min<size_t>(expected.size(), 5));
+
+    const auto whole_top = evaluator.Evaluate(whole, query_words, Ranking::Bm25);
+    const auto& segmented_top = evaluator.Evaluate(segmented, query_words, Ranking::Bm25);
+    ASSERT_EQUAL(whole_top.size(), expected.size());
+    ASSERT_EQUAL(segmented_top.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      ASSERT(abs(whole_top[i].score - expected[i].first) < 1e-4 * expected[i].first);
+      ASSERT_EQUAL(segmented_top[i].docid, whole_top[i].docid);
+      ASSERT_EQUAL(segmented_top[i].score, whole_top[i].score);
+    }
+  }
+
+  istringstream server_docs("x y\nx x z\n"), server_queries("x\nnothing\n");
+  ostringstream output;
+  {
+    SearchServer server(server_docs, Ranking::Bm25);
+    server.AddQueriesStream(server_queries, output);
+  }
+  const string result = output.str();
+  const auto lines = SplitBy(Strip(result), '\n');
+  ASSERT_EQUAL(lines.size(), 2u);
+  ASSERT(lines[0].substr(0, 21) == "x: {docid: 1, score: ");
+  ASSERT(lines[0].find("{docid: 0, score: ") != string_view::npos);
+  ASSERT_EQUAL(lines[1], "nothing:");
+}
+
+void TestPruningMatchesExhaustive() {
+  // Частоты слов убывают как у естественного языка, так что в запросах
+  // встречаются и очень длинные, и короткие списки постингов
+  mt19937 rng(41);
+  vector<string> words;
+  vector<double> weights;
+  for (int i = 0; i < 300; ++i) {
+    words.push_back("w" + to_string(i));
+    weights.push_back(1.0 / (i + 1));
+  }
+  discrete_distribution<size_t> word_id(weights.begin(), weights.end());
+  uniform_int_distribution<size_t> doc_length(1, 40);
+  auto generate_docs = [&](size_t count) {
+    string text;
+    for (size_t doc = 0; doc < count; ++doc) {
+      for (size_t i = doc_length(rng); i > 0; --i) {
+        text += words[word_id(rng)] + ' ';
+      }
+      text += '\n';
+    }
+    return text;
+  };
+
+  istringstream whole_input(generate_docs(6000));
+  const InvertedIndex whole(whole_input);
+  SegmentedIndex segmented;
+  for (size_t size : {3000, 1000, 200, 50}) {
+    istringstream part_input(generate_docs(size));
+    segmented = segmented.Append(InvertedIndex(part_input));
+  }
+  uniform_int_distribution<uint32_t> any_docid(0, segmented.GetDocumentCount() - 1);
+  for (int i = 0; i < 300; ++i) {
+    segmented = segmented.Delete(any_docid(rng));
+  }
+
+  QueryEvaluator exhaustive({}, false), pruned;
+  uniform_int_distribution<size_t> query_length(1, 6);
+  for (int query = 0; query < 400; ++query) {
+    vector<string> query_words;
+    for (size_t i = query_length(rng); i > 0; --i) {
+      query_words.push_back(query % 7 == 0 ? "missing" : words[word_id(rng)]);
+    }
+    const vector<string_view> query_views(query_words.begin(), query_words.end());
+    for (Ranking ranking : {Ranking::HitCount, Ranking::Bm25}) {
+      for (bool use_segments : {false, true}) {
+        const auto expected = use_segments
+          ? exhaustive.Evaluate(segmented, query_views, ranking)
+          : exhaustive.Evaluate(whole, query_views, ranking);
+        const auto& found = use_segments
+          ? pruned.Evaluate(segmented, query_views, ranking)
+          : pruned.Evaluate(whole, query_views, ranking);
+        ASSERT_EQUAL(found.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+          ASSERT_EQUAL(found[i].docid, expected[i].docid);
+          ASSERT_EQUAL(found[i].hitcount, expected[i].hitcount);
+          ASSERT_EQUAL(found[i].score, expected[i].score);
+        }
+      }
+    }
+  }
+}
+
+vector<string_view> SplitWithReadToken(string_view str) {
+  vector<string_view> result;
+  for (string_view word = ReadToken(str); !word.empty(); word = ReadToken(str)) {
+    result.push_back(word);
+  }
+  return result;
+}
+
+void TestSplitIntoWords() {
+  ASSERT(SplitIntoWordsView("") == vector<string_view>{});
+  ASSERT((SplitIntoWordsView("  a\tb  c\n") == vector<string_view>{"a\tb", "c\n"}));
+
+  mt19937 rng(31);
+  const string alphabet = string(" \t\n\v\f\r\x01\x80\xff") + "abc";
+  uniform_int_distribution<size_t> char_id(0, alphabet.size() - 1), length(0, 300), offset(0, 15);
+  vector<string_view> words;
+  for (int i = 0; i < 3000; ++i) {
+    string text(length(rng), ' ');
+    for (char& c : text) {
+      c = alphabet[char_id(rng)];
+    }
+    // Разные смещения проверяют блоки, не выровненные по памяти
+    const string_view str = string_view(text).substr(min(offset(rng), text.size()));
+    SplitIntoWordsView(str, words);
+    ASSERT(words == SplitWithReadToken(str));
+  }
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestSerpFormat);
@@ -208,4 +1156,22 @@ int main() {
   RUN_TEST(tr, TestHitcount);
   RUN_TEST(tr, TestRanking);
   RUN_TEST(tr, TestBasicSearch);
+  RUN_TEST(tr, TestUpdateWhileSearching);
+  RUN_TEST(tr, TestBm25Ranking);
+  RUN_TEST(tr, TestPruningMatchesExhaustive);
+  RUN_TEST(tr, TestSplitIntoWords);
+  RUN_TEST(tr, TestPostingsCodec);
+  RUN_TEST(tr, TestQueryEvaluator);
+  RUN_TEST(tr, TestShardedIndexBuild);
+  RUN_TEST(tr, TestIndexSegment);
+  RUN_TEST(tr, TestIncrementalUpdates);
+  RUN_TEST(tr, TestBackgroundUpdates);
+  RUN_TEST(tr, TestSegmentMerge);
+  RUN_TEST(tr, TestQueryCache);
+  RUN_TEST(tr, TestLatencyHistograms);
+  RUN_TEST(tr, TestPositionalIndex);
+  RUN_TEST(tr, TestParallelScoring);
+  RUN_TEST(tr, TestLargeQueryStream);
+  RUN_TEST(tr, TestIndexSpeed);
+  RUN_TEST(tr, TestParallelQuerySpeed);
 }
@@ -1,5 +1,14 @@
 #include "parse.h"
 
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 string_view Strip(string_view s) {
   while (!s.empty() && isspace(s.front())) {
     s.remove_prefix(1);
@@ -35,13 +44,160 @@ string_view ReadToken(string_view& sv) {
   return result;
 }
 
-vector<string_view> SplitIntoWordsView(string_view str) {
-  vector<string_view> result;
+namespace {
+  // Позиции пробелов ' ' и всех пробельных символов в смысле isspace
+  // из локали "C" (' ' и '\t'..'\r') внутри блока из 64 байт
+  struct BlockMasks {
+    uint64_t spaces;
+    uint64_t whitespace;
+  };
+
+  const size_t BLOCK_SIZE = 64;
+
+  BlockMasks ClassifyTail(const char* data, size_t size) {
+    BlockMasks masks = {0, 0};
+    for (size_t i = 0; i < size; ++i) {
+      const uint8_t c = data[i];
+      if (c == ' ') {
+        masks.spaces |= uint64_t(1) << i;
+      }
+      if (c == ' ' || uint8_t(c - '\t') <= '\r' - '\t') {
+        masks.whitespace |= uint64_t(1) << i;
+      }
+    }
+    return masks;
+  }
 
-  for (string_view word = ReadToken(str); !word.empty(); word = ReadToken(str)) {
-    result.push_back(word);
+#if defined(__AVX2__)
+  BlockMasks ClassifyBlock(const char* data) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i control_range = _mm256_set1_epi8('\r' - '\t');
+    BlockMasks masks = {0, 0};
+    for (int half = 0; half < 2; ++half) {
+      const __m256i chars = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + 32 * half));
+      const __m256i is_space = _mm256_cmpeq_epi8(chars, space);
+      const __m256i shifted = _mm256_sub_epi8(chars, tab);
+      const __m256i is_control = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, control_range), shifted);
+      masks.spaces |= uint64_t(uint32_t(_mm256_movemask_epi8(is_space))) << (32 * half);
+      masks.whitespace |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_or_si256(is_space, is_control)))) << (32 * half);
+    }
+    return masks;
   }
+#elif defined(__SSE2__)
+  BlockMasks ClassifyBlock(const char* data) {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i control_range = _mm_set1_epi8('\r' - '\t');
+    BlockMasks masks = {0, 0};
+    for (int quarter = 0; quarter < 4; ++quarter) {
+      const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * quarter));
+      const __m128i is_space = _mm_cmpeq_epi8(chars, space);
+      const __m128i shifted = _mm_sub_epi8(chars, tab);
+      const __m128i is_control = _mm_cmpeq_epi8(_mm_min_epu8(shifted, control_range), shifted);
+      masks.spaces |= uint64_t(_mm_movemask_epi8(is_space)) << (16 * quarter);
+      masks.whitespace |= uint64_t(_mm_movemask_epi8(_mm_or_si128(is_space, is_control))) << (16 * quarter);
+    }
+    return masks;
+  }
+#else
+  BlockMasks ClassifyBlock(const char* data) {
+    return ClassifyTail(data, BLOCK_SIZE);
+  }
+#endif
+
+  int CountTrailingZeros(uint64_t mask) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(mask);
+#else
+    int result = 0;
+    for (; (mask & 1) == 0; mask >>= 1) {
+      ++result;
+    }
+    return result;
+#endif
+  }
+}
+
+void SplitIntoWordsView(string_view str, vector<string_view>& words) {
+  // Те же границы, что и у цепочки ReadToken: слово начинается с первого
+  // непробельного символа, а заканчивается только на ' '. Внутри блока
+  // следующая граница ищется по битовой маске, а не посимвольно.
+  words.clear();
+  bool in_word = false;
+  size_t word_begin = 0;
+  for (size_t block = 0; block < str.size(); block += BLOCK_SIZE) {
+    const size_t size = min(BLOCK_SIZE, str.size() - block);
+    const BlockMasks masks = size == BLOCK_SIZE
+      ? ClassifyBlock(str.data() + block)
+      : ClassifyTail(str.data() + block, size);
+    const uint64_t word_chars = ~masks.whitespace & (size == BLOCK_SIZE ? ~uint64_t(0) : (uint64_t(1) << size) - 1);
 
+    uint64_t remaining = ~uint64_t(0);
+    while (const uint64_t boundaries = (in_word ? masks.spaces : word_chars) & remaining) {
+      const int bit = CountTrailingZeros(boundaries);
+      if (in_word) {
+        words.push_back(str.substr(word_begin, block + bit - word_begin));
+      } else {
+        word_begin = block + bit;
+      }
+      in_word = !in_word;
+      remaining = bit == 63 ? 0 : ~uint64_t(0) << (bit + 1);
+    }
+  }
+  if (in_word) {
+    words.push_back(str.substr(word_begin));
+  }
+}
+
+vector<string_view> SplitIntoWordsView(string_view str) {
+  vector<string_view> result;
+  SplitIntoWordsView(str, result);
   return result;
 }
 
+void ParseQuery(string_view str, Query& query, bool parse_phrases) {
+  if (!parse_phrases || str.find('"') == str.npos) {
+    query.phrases.clear();
+    SplitIntoWordsView(str, query.words);
+    return;
+  }
+
+  SplitIntoWordsView(str, query.tokens);
+  query.words.clear();
+  // Списки слов фраз прошлого запроса очищаются и заполняются заново
+  size_t phrase_count = 0;
+  vector<string_view>* phrase = nullptr;
+  for (string_view token : query.tokens) {
+    if (!phrase && token.front() == '"') {
+      token.remove_prefix(1);
+      if (phrase_count == query.phrases.size()) {
+        query.phrases.emplace_back();
+      }
+      phrase = &query.phrases[phrase_count++];
+      phrase->clear();
+    }
+    const bool closes = phrase && !token.empty() && token.back() == '"';
+    if (closes) {
+      token.remove_suffix(1);
+    }
+    if (!token.empty()) {
+      (phrase ? *phrase : query.words).push_back(token);
+    }
+    if (closes) {
+      phrase = nullptr;
+    }
+  }
+
+  // Фразы из одного слова переходят в words; остальные сдвигаются
+  // к началу обменом, чтобы не копировать их списки
+  size_t long_phrases = 0;
+  for (size_t i = 0; i < phrase_count; ++i) {
+    if (query.phrases[i].size() > 1) {
+      swap(query.phrases[long_phrases++], query.phrases[i]);
+    } else {
+      query.words.insert(query.words.end(), query.phrases[i].begin(), query.phrases[i].end());
+    }
+  }
+  query.phrases.resize(long_phrases);
+}
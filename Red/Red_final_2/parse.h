@@ -23,3 +23,18 @@ void LeftStrip(string_view& sv);
 string_view ReadToken(string_view& sv);
 
 vector<string_view> SplitIntoWordsView(string_view str);
+// Кладёт слова str в words, переиспользуя его память
+void SplitIntoWordsView(string_view str, vector<string_view>& words);
+
+// Запрос из отдельных слов и фраз в двойных кавычках. Слова фраз в words
+// не попадают; фраза из одного слова считается обычным словом, а
+// незакрытая кавычка продолжает фразу до конца запроса. Без parse_phrases
+// кавычки остаются частью слов, как в запросах без фраз. Память запроса
+// переиспользуется при разборе следующего.
+struct Query {
+  vector<string_view> words;
+  vector<vector<string_view>> phrases;
+  // Слова запроса вместе с кавычками
+  vector<string_view> tokens;
+};
+void ParseQuery(string_view str, Query& query, bool parse_phrases = true);
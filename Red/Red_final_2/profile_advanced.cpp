@@ -0,0 +1,130 @@
+#include "profile_advanced.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sstream>
+
+TotalDuration::TotalDuration(const string& msg)
+  : message(msg + ": ")
+  , value(0)
+{
+}
+
+TotalDuration::~TotalDuration() {
+  ostringstream os;
+  os << message
+     << duration_cast<milliseconds>(value).count()
+     << " ms" << endl;
+  cerr << os.str();
+}
+
+AddDuration::AddDuration(steady_clock::duration& dest)
+  : add_to(dest)
+  , start(steady_clock::now())
+{
+}
+
+AddDuration::AddDuration(TotalDuration& dest)
+  : AddDuration(dest.value)
+{
+}
+
+AddDuration::~AddDuration() {
+  add_to += steady_clock::now() - start;
+}
+
+uint64_t LatencyHistogram::BucketLimit(size_t bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  const size_t shift = bucket / SUB_BUCKETS - 1;
+  const uint64_t mantissa = bucket % SUB_BUCKETS + SUB_BUCKETS;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(steady_clock::duration value) {
+  Add(BucketOf(max<int64_t>(duration_cast<nanoseconds>(value).count(), 0)), 1);
+}
+
+void LatencyHistogram::Add(size_t bucket, uint64_t count) {
+  counts[bucket] += count;
+  total += count;
+}
+
+nanoseconds LatencyHistogram::Percentile(double quantile) const {
+  if (total == 0) {
+    return nanoseconds(0);
+  }
+  const uint64_t rank = clamp<uint64_t>(ceil(quantile * total), 1, total);
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+    seen += counts[bucket];
+    if (seen >= rank) {
+      return nanoseconds(BucketLimit(bucket));
+    }
+  }
+  return Max();
+}
+
+nanoseconds LatencyHistogram::Max() const {
+  for (size_t bucket = BUCKET_COUNT; bucket > 0; --bucket) {
+    if (counts[bucket - 1]) {
+      return nanoseconds(BucketLimit(bucket - 1));
+    }
+  }
+  return nanoseconds(0);
+}
+
+void LatencyHistogram::WriteJson(ostream& out) const {
+  out << "{\"count\": " << total
+      << ", \"p50_ns\": " << Percentile(0.5).count()
+      << ", \"p99_ns\": " << Percentile(0.99).count()
+      << ", \"p999_ns\": " << Percentile(0.999).count()
+      << ", \"max_ns\": " << Max().count() << '}';
+}
+
+namespace {
+  atomic<uint64_t> last_recorder_id = 0;
+}
+
+LatencyRecorder::LatencyRecorder(vector<string> stage_names)
+  : id(++last_recorder_id)
+  , stage_names(move(stage_names))
+{
+}
+
+void LatencyRecorder::AttachThread() {
+#if LATENCY_HISTOGRAMS
+  if (current.recorder_id == id) {
+    return;
+  }
+  auto counts = make_unique<atomic<uint64_t>[]>(stage_names.size() * LatencyHistogram::BUCKET_COUNT);
+  current.recorder_id = id;
+  current.counts = counts.get();
+  lock_guard guard(m);
+  thread_counts.push_back(move(counts));
+#endif
+}
+
+LatencyHistogram LatencyRecorder::GetHistogram(size_t stage) const {
+  LatencyHistogram histogram;
+  lock_guard guard(m);
+  for (const auto& counts : thread_counts) {
+    for (size_t bucket = 0; bucket < LatencyHistogram::BUCKET_COUNT; ++bucket) {
+      if (const uint64_t count = counts[stage * LatencyHistogram::BUCKET_COUNT + bucket].load(memory_order_relaxed)) {
+        histogram.Add(bucket, count);
+      }
+    }
+  }
+  return histogram;
+}
+
+void LatencyRecorder::WriteJson(ostream& out) const {
+  out << '{';
+  for (size_t stage = 0; stage < stage_names.size(); ++stage) {
+    out << (stage ? ", \"" : "\"") << stage_names[stage] << "\": ";
+    GetHistogram(stage).WriteJson(out);
+  }
+  out << '}';
+}
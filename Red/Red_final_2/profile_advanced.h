@@ -0,0 +1,164 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+using namespace std;
+using namespace chrono;
+
+struct TotalDuration {
+  string message;
+  steady_clock::duration value;
+
+  explicit TotalDuration(const string& msg);
+  ~TotalDuration();
+};
+
+class AddDuration {
+public:
+  explicit AddDuration(steady_clock::duration& dest);
+  explicit AddDuration(TotalDuration& dest);
+
+  ~AddDuration();
+
+private:
+  steady_clock::duration& add_to;
+  steady_clock::time_point start;
+};
+
+#define MY_UNIQ_ID_IMPL(lineno) _a_local_var_##lineno
+#define MY_UNIQ_ID(lineno) MY_UNIQ_ID_IMPL(lineno)
+
+#define ADD_DURATION(value) \
+  AddDuration MY_UNIQ_ID(__LINE__){value};
+
+// Сборка с -DLATENCY_HISTOGRAMS=0 превращает LatencyRecorder::AttachThread,
+// StartQuery, Lap и FinishQuery в пустые функции: потоки не получают
+// счётчиков, и замеры ничего не стоят.
+#ifndef LATENCY_HISTOGRAMS
+#define LATENCY_HISTOGRAMS 1
+#endif
+
+// Гистограмма задержек в духе HDR Histogram: каждая степень двойки
+// наносекунд делится на SUB_BUCKETS равных корзин, так что значение
+// восстанавливается с погрешностью не больше 1/SUB_BUCKETS при любом
+// масштабе, от наносекунд до часов.
+class LatencyHistogram {
+public:
+  static constexpr int SUB_BUCKET_BITS = 5;
+  static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+  static constexpr size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  static size_t BucketOf(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+      return ns;
+    }
+    const int shift = 63 - __builtin_clzll(ns) - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (ns >> shift) - SUB_BUCKETS;
+  }
+
+  // Наибольшее значение, попадающее в корзину
+  static uint64_t BucketLimit(size_t bucket);
+
+  void Record(steady_clock::duration value);
+  void Add(size_t bucket, uint64_t count);
+
+  uint64_t GetCount() const {
+    return total;
+  }
+  // Значение, которого не превосходит доля quantile записей
+  nanoseconds Percentile(double quantile) const;
+  nanoseconds Max() const;
+  // {"count": ..., "p50_ns": ..., "p99_ns": ..., "p999_ns": ..., "max_ns": ...}
+  void WriteJson(ostream& out) const;
+
+private:
+  vector<uint64_t> counts = vector<uint64_t>(BUCKET_COUNT);
+  uint64_t total = 0;
+};
+
+// Собирает задержки этапов обработки запроса в гистограммы, отдельные
+// для каждого потока, так что запись не требует синхронизации. Поток
+// вызывает AttachThread, после чего StartQuery засекает начало запроса,
+// Lap(stage) относит ко stage время с предыдущей отметки, а FinishQuery
+// записывает накопленное по каждому затронутому этапу одним значением.
+// Гистограммы всех потоков можно в любой момент сложить и прочитать.
+class LatencyRecorder {
+public:
+  static constexpr size_t MAX_STAGES = 8;
+
+  explicit LatencyRecorder(vector<string> stage_names);
+
+  LatencyRecorder(const LatencyRecorder&) = delete;
+  LatencyRecorder& operator=(const LatencyRecorder&) = delete;
+
+  // Поток, записывающий то в один, то в другой рекордер, каждый раз
+  // получает новую гистограмму, поэтому рассчитано на потоки, которые
+  // работают на один рекордер, как потоки пула одного сервера.
+  void AttachThread();
+
+  static void StartQuery() {
+#if LATENCY_HISTOGRAMS
+    current.active = true;
+    current.last = steady_clock::now();
+#endif
+  }
+
+  template <typename Stage>
+  static void Lap([[maybe_unused]] Stage stage) {
+#if LATENCY_HISTOGRAMS
+    if (!current.active) {
+      return;
+    }
+    const auto now = steady_clock::now();
+    current.pending[static_cast<size_t>(stage)] += now - current.last;
+    current.touched |= 1u << static_cast<size_t>(stage);
+    current.last = now;
+#endif
+  }
+
+  static void FinishQuery() {
+#if LATENCY_HISTOGRAMS
+    for (size_t stage = 0; current.touched; ++stage, current.touched >>= 1) {
+      if (current.touched & 1) {
+        const uint64_t ns = duration_cast<nanoseconds>(current.pending[stage]).count();
+        auto& count = current.counts[stage * LatencyHistogram::BUCKET_COUNT + LatencyHistogram::BucketOf(ns)];
+        count.store(count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        current.pending[stage] = {};
+      }
+    }
+    current.active = false;
+#endif
+  }
+
+  const vector<string>& GetStageNames() const {
+    return stage_names;
+  }
+  LatencyHistogram GetHistogram(size_t stage) const;
+  // Объект с гистограммой для каждого этапа под его именем
+  void WriteJson(ostream& out) const;
+
+private:
+  // Как у любой thread_local переменной, поля изначально нулевые
+  struct ThreadState {
+    uint64_t recorder_id;
+    // Счётчики потока в рекордере: BUCKET_COUNT на каждый этап
+    atomic<uint64_t>* counts;
+    bool active;
+    uint32_t touched;
+    steady_clock::time_point last;
+    steady_clock::duration pending[MAX_STAGES];
+  };
+  static inline thread_local ThreadState current;
+
+  const uint64_t id;
+  const vector<string> stage_names;
+  mutable mutex m;
+  vector<unique_ptr<atomic<uint64_t>[]>> thread_counts;
+};
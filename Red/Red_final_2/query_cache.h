@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+using namespace std;
+
+// LRU-кеш готовых ответов на запросы. Ключи распределяются по независимым
+// частям со своими мьютексами, чтобы потоки пула редко ждали друг друга.
+// Каждая запись помечена поколением индекса, по которому посчитан ответ,
+// и для других поколений не находится, так что подмена индекса делает
+// весь кеш недействительным, а старые записи вытесняются по LRU.
+class QueryCache {
+public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Суммарное время, проведённое в Get
+    chrono::nanoseconds lookup_time{0};
+
+    double HitRate() const {
+      return hits + misses == 0 ? 0 : static_cast<double>(hits) / (hits + misses);
+    }
+  };
+
+  // Нулевая ёмкость отключает кеш
+  explicit QueryCache(size_t capacity = 1 << 16, size_t shard_count = 16)
+    : shard_capacity(capacity == 0 ? 0 : max<size_t>((capacity + shard_count - 1) / shard_count, 1))
+    , shards(shard_count)
+  {
+  }
+
+  QueryCache(const QueryCache&) = delete;
+  QueryCache& operator=(const QueryCache&) = delete;
+
+  bool IsEnabled() const {
+    return shard_capacity != 0;
+  }
+
+  optional<string> Get(const string& key, uint64_t generation) {
+    if (!IsEnabled()) {
+      return nullopt;
+    }
+    const auto start = chrono::steady_clock::now();
+    optional<string> result;
+    {
+      Shard& shard = GetShard(key);
+      lock_guard guard(shard.m);
+      if (auto it = shard.positions.find(key); it != shard.positions.end() && it->second->generation == generation) {
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        result = it->second->value;
+      }
+    }
+    (result ? hits : misses).fetch_add(1, memory_order_relaxed);
+    lookup_ns.fetch_add(
+      chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(),
+      memory_order_relaxed
+    );
+    return result;
+  }
+
+  void Put(const string& key, string value, uint64_t generation) {
+    if (!IsEnabled()) {
+      return;
+    }
+    Shard& shard = GetShard(key);
+    lock_guard guard(shard.m);
+    if (auto it = shard.positions.find(key); it != shard.positions.end()) {
+      // Запись могла остаться от другого поколения или быть добавлена
+      // параллельно; в любом случае последнее слово за более новым индексом
+      if (it->second->generation <= generation) {
+        it->second->value = move(value);
+        it->second->generation = generation;
+      }
+      shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+      return;
+    }
+    if (shard.entries.size() >= shard_capacity) {
+      shard.positions.erase(shard.entries.back().key);
+      shard.entries.pop_back();
+    }
+    shard.entries.push_front({key, move(value), generation});
+    shard.positions.emplace(shard.entries.front().key, shard.entries.begin());
+  }
+
+  Stats GetStats() const {
+    return {
+      hits.load(memory_order_relaxed),
+      misses.load(memory_order_relaxed),
+      chrono::nanoseconds(lookup_ns.load(memory_order_relaxed)),
+    };
+  }
+
+private:
+  struct Entry {
+    string key;
+    string value;
+    uint64_t generation;
+  };
+
+  struct Shard {
+    mutex m;
+    // От недавно использованных к давно использованным
+    list<Entry> entries;
+    // Ключи ссылаются на строки внутри entries
+    unordered_map<string_view, list<Entry>::iterator> positions;
+  };
+
+  Shard& GetShard(const string& key) {
+    return shards[hash<string>{}(key) % shards.size()];
+  }
+
+  size_t shard_capacity;
+  vector<Shard> shards;
+  atomic<uint64_t> hits = 0;
+  atomic<uint64_t> misses = 0;
+  atomic<uint64_t> lookup_ns = 0;
+};
@@ -4,106 +4,1803 @@
 #include "iterator_range.h"
 
 #include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <fstream>
 #include <future>
-#include <numeric>
-
-InvertedIndex::InvertedIndex(istream& document_input) {
-  for (string current_document; getline(document_input, current_document); ) {
-    docs.push_back(move(current_document));
-    size_t docid = docs.size() - 1;
-    for (string_view word : SplitIntoWordsView(docs.back())) {
-      auto& docids = index[word];
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+  const char SEGMENT_MAGIC[8] = {'S', 'R', 'V', 'S', 'E', 'G', '0', '4'};
+
+  // Хеш должен быть одинаковым во всех сборках, которые читают сегмент,
+  // поэтому вместо std::hash используется FNV-1a.
+  uint64_t HashWord(string_view word) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : word) {
+      hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  size_t AlignSection(size_t offset) {
+    return (offset + 7) & ~size_t(7);
+  }
+
+  void AppendVarint(vector<uint8_t>& out, uint32_t value) {
+    while (value >= 0x80) {
+      out.push_back(value | 0x80);
+      value >>= 7;
+    }
+    out.push_back(value);
+  }
+
+  uint32_t ReadVarint(const uint8_t*& in) {
+    uint32_t value = 0;
+    for (int shift = 0; ; shift += 7) {
+      const uint8_t byte = *in++;
+      value |= uint32_t(byte & 0x7F) << shift;
+      if (byte < 0x80) {
+        return value;
+      }
+    }
+  }
+
+  // Каждое число кончается единственным байтом без старшего бита
+  const uint8_t* SkipVarints(const uint8_t* in, size_t count) {
+    for (; count > 0; ++in) {
+      count -= *in < 0x80;
+    }
+    return in;
+  }
+
+  size_t PositionsBlockCount(size_t postings_count) {
+    return postings_count > PostingsView::BLOCK_SIZE
+      ? (postings_count + PostingsView::BLOCK_SIZE - 1) / PostingsView::BLOCK_SIZE
+      : 0;
+  }
+}
+
+uint8_t EncodeDocumentLength(uint32_t length) {
+  if (length < 16) {
+    return length;
+  }
+  int shift = 0;
+  while ((length >> shift) >= 16) {
+    ++shift;
+  }
+  return 8 * shift + (length >> shift);
+}
+
+uint32_t DecodeDocumentLength(uint8_t code) {
+  if (code < 16) {
+    return code;
+  }
+  return uint32_t(code % 8 + 8) << (code / 8 - 1);
+}
+
+InvertedIndex::InvertedIndex() {
+  Shard empty;
+  WriteSegment(empty, true);
+}
+
+InvertedIndex::InvertedIndex(
+  istream& document_input, size_t block_size, size_t threads, bool store_documents, bool store_positions
+) {
+  deque<string> blocks;
+  Shard merged;
+  merged.store_positions = store_positions;
+  Rehash(merged.terms, 16);
+
+  // Блоки сливаются в порядке чтения, поэтому номера документов
+  // и постинги получаются теми же, что и при чтении по одной строке.
+  deque<future<Shard>> shards;
+  while (document_input) {
+    string block(block_size, '\0');
+    document_input.read(block.data(), block.size());
+    block.resize(document_input.gcount());
+    if (block.empty()) {
+      break;
+    }
+    if (block.back() != '\n') {
+      string tail;
+      if (getline(document_input, tail)) {
+        block += tail;
+        block += '\n';
+      }
+    }
+    blocks.push_back(move(block));
+    shards.push_back(async(launch::async, BuildShard, string_view(blocks.back()), store_positions));
+    if (shards.size() >= threads) {
+      MergeShard(merged, shards.front().get());
+      shards.pop_front();
+    }
+  }
+  for (auto& shard : shards) {
+    MergeShard(merged, shard.get());
+  }
+
+  WriteSegment(merged, store_documents);
+}
+
+InvertedIndex::Shard InvertedIndex::BuildShard(string_view text, bool store_positions) {
+  Shard shard;
+  shard.store_positions = store_positions;
+  Rehash(shard.terms, 16);
+  vector<string_view> words;
+  while (!text.empty()) {
+    const size_t eol = text.find('\n');
+    shard.docs.push_back(text.substr(0, eol));
+    text.remove_prefix(eol == text.npos ? text.size() : eol + 1);
+
+    const uint32_t docid = shard.docs.size() - 1;
+    SplitIntoWordsView(shard.docs.back(), words);
+    shard.length_codes.push_back(EncodeDocumentLength(words.size()));
+    shard.total_length += words.size();
+    for (uint32_t position = 0; position < words.size(); ++position) {
+      const uint32_t term = AddTerm(shard, words[position]);
+      auto& docids = shard.term_postings[term];
       if (!docids.empty() && docids.back().docid == docid) {
         ++docids.back().hitcount;
       } else {
         docids.push_back({docid, 1});
       }
+      if (store_positions) {
+        shard.term_positions[term].push_back(position);
+      }
     }
   }
+  return shard;
 }
 
-const vector<InvertedIndex::Entry>& InvertedIndex::Lookup(string_view word) const {
-  static const vector<Entry> empty;
-  if (auto it = index.find(word); it != index.end()) {
-    return it->second;
-  } else {
-    return empty;
+void InvertedIndex::MergeShard(Shard& merged, Shard shard) {
+  const uint32_t first_docid = merged.docs.size();
+  merged.docs.insert(merged.docs.end(), shard.docs.begin(), shard.docs.end());
+  merged.length_codes.insert(merged.length_codes.end(), shard.length_codes.begin(), shard.length_codes.end());
+  merged.total_length += shard.total_length;
+  for (const auto& shard_term : shard.terms) {
+    if (!shard_term.word.empty()) {
+      const uint32_t term = AddTerm(merged, shard_term.word);
+      for (auto [docid, hitcount] : shard.term_postings[shard_term.index]) {
+        merged.term_postings[term].push_back({first_docid + docid, hitcount});
+      }
+      if (merged.store_positions) {
+        const auto& positions = shard.term_positions[shard_term.index];
+        merged.term_positions[term].insert(merged.term_positions[term].end(), positions.begin(), positions.end());
+      }
+    }
+  }
+}
+
+uint32_t InvertedIndex::AddTerm(Shard& shard, string_view word) {
+  Term& term = shard.terms[FindSlot(shard.terms, word)];
+  if (!term.word.empty()) {
+    return term.index;
   }
+  const uint32_t index = shard.term_postings.size();
+  term = {word, index};
+  shard.term_postings.emplace_back();
+  if (shard.store_positions) {
+    shard.term_positions.emplace_back();
+  }
+  if (2 * shard.term_postings.size() > shard.terms.size()) {
+    Rehash(shard.terms, 2 * shard.terms.size());
+  }
+  return index;
 }
 
-void UpdateIndex(istream& document_input, Synchronized<InvertedIndex>& index) {
-  InvertedIndex new_index(document_input);
-  swap(index.GetAccess().ref_to_value, new_index);
+size_t InvertedIndex::FindSlot(const vector<Term>& terms, string_view word) {
+  const size_t mask = terms.size() - 1;
+  size_t slot = HashWord(word) & mask;
+  while (!terms[slot].word.empty() && terms[slot].word != word) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
 }
 
-void ProcessSearches(
-  istream& query_input,
-  ostream& search_results_output,
-  Synchronized<InvertedIndex>& index_handle
+void InvertedIndex::Rehash(vector<Term>& terms, size_t new_capacity) {
+  vector<Term> old_terms(new_capacity);
+  swap(terms, old_terms);
+  for (const auto& term : old_terms) {
+    if (!term.word.empty()) {
+      terms[FindSlot(terms, term.word)] = term;
+    }
+  }
+}
+
+namespace {
+  void EncodeGroup(const uint32_t (&values)[4], vector<uint8_t>& out) {
+    const size_t control_pos = out.size();
+    out.push_back(0);
+    uint8_t control = 0;
+    for (int i = 0; i < 4; ++i) {
+      const uint32_t value = values[i];
+      const int length = value < (1u << 8) ? 1 : value < (1u << 16) ? 2 : value < (1u << 24) ? 3 : 4;
+      control |= (length - 1) << (2 * i);
+      for (int byte = 0; byte < length; ++byte) {
+        out.push_back((value >> (8 * byte)) & 0xFF);
+      }
+    }
+    out[control_pos] = control;
+  }
+}
+
+void EncodePostings(
+  const vector<InvertedIndex::Entry>& docids, vector<uint8_t>& out,
+  vector<PostingsSkip>* skips, const uint8_t* length_codes
+) {
+  const size_t start = out.size();
+  uint32_t prev_docid = 0;
+  for (size_t i = 0; i < docids.size(); i += 2) {
+    // Блок кончается на границе группы, так как BLOCK_SIZE чётен
+    if (skips && docids.size() > PostingsView::BLOCK_SIZE && i % PostingsView::BLOCK_SIZE == 0) {
+      const size_t block_end = min(docids.size(), i + PostingsView::BLOCK_SIZE);
+      PostingsSkip skip = {docids[block_end - 1].docid, 0, 0, numeric_limits<uint8_t>::max()};
+      for (size_t j = i; j < block_end; ++j) {
+        skip.max_hitcount = max(skip.max_hitcount, docids[j].hitcount);
+        skip.min_length_code = min<uint32_t>(skip.min_length_code, length_codes[docids[j].docid]);
+      }
+      if (i != 0) {
+        skips->back().end_offset = out.size() - start;
+      }
+      skips->push_back(skip);
+    }
+
+    uint32_t values[4] = {docids[i].docid - prev_docid, docids[i].hitcount, 0, 0};
+    prev_docid = docids[i].docid;
+    if (i + 1 < docids.size()) {
+      values[2] = docids[i + 1].docid - prev_docid;
+      values[3] = docids[i + 1].hitcount;
+      prev_docid = docids[i + 1].docid;
+    }
+    EncodeGroup(values, out);
+  }
+  if (skips && docids.size() > PostingsView::BLOCK_SIZE) {
+    skips->back().end_offset = out.size() - start;
+  }
+}
+
+namespace {
+  // Дописывает поток позиций слова в формате PositionsView
+  void EncodePositions(
+    const vector<InvertedIndex::Entry>& docids, const vector<uint32_t>& positions, vector<uint8_t>& out
+  ) {
+    const size_t table = out.size();
+    out.resize(table + PositionsBlockCount(docids.size()) * sizeof(uint32_t));
+    const size_t start = out.size();
+    auto position = positions.begin();
+    for (size_t i = 0; i < docids.size(); ++i) {
+      if (table != start && i % PostingsView::BLOCK_SIZE == 0) {
+        const uint32_t offset = out.size() - start;
+        copy_n(reinterpret_cast<const uint8_t*>(&offset), sizeof(offset),
+               out.begin() + table + i / PostingsView::BLOCK_SIZE * sizeof(uint32_t));
+      }
+      uint32_t prev = 0;
+      for (uint32_t k = 0; k < docids[i].hitcount; ++k, ++position) {
+        AppendVarint(out, *position - prev);
+        prev = *position;
+      }
+    }
+  }
+}
+
+InvertedIndex::Layout InvertedIndex::GetLayout(const Header& header) {
+  Layout layout;
+  layout.terms = AlignSection(sizeof(Header));
+  layout.words = layout.terms + header.term_slots * sizeof(SegmentTerm);
+  layout.doc_offsets = AlignSection(layout.words + header.words_bytes);
+  layout.documents = layout.doc_offsets + (header.has_documents ? (header.doc_count + 1) * sizeof(uint64_t) : 0);
+  layout.length_codes = layout.documents + header.documents_bytes;
+  layout.postings = AlignSection(layout.length_codes + header.doc_count);
+  layout.skips = AlignSection(layout.postings + header.postings_bytes);
+  layout.positions = AlignSection(layout.skips + header.skips_count * sizeof(PostingsSkip));
+  layout.end = layout.positions + header.positions_bytes;
+  return layout;
+}
+
+void InvertedIndex::WriteSegment(Shard& merged, bool store_documents) {
+  Header new_header;
+  copy(begin(SEGMENT_MAGIC), end(SEGMENT_MAGIC), new_header.magic);
+  new_header.term_slots = merged.terms.size();
+  for (const auto& term : merged.terms) {
+    new_header.words_bytes += term.word.size();
+  }
+  new_header.doc_count = merged.docs.size();
+  new_header.total_length = merged.total_length;
+  new_header.has_documents = store_documents;
+  new_header.has_positions = merged.store_positions;
+  if (store_documents) {
+    for (string_view doc : merged.docs) {
+      new_header.documents_bytes += doc.size();
+    }
+  }
+  const Layout layout = GetLayout(new_header);
+
+  // Постинги идут последними и кодируются прямо в конец сегмента
+  vector<uint8_t> buffer(layout.postings);
+  vector<SegmentTerm> new_terms(new_header.term_slots, SegmentTerm{0, 0, 0, 0, 0, 0, 0});
+  vector<PostingsSkip> new_skips;
+  vector<uint64_t> positions_offsets(merged.store_positions ? new_header.term_slots : 0);
+  vector<uint8_t> new_positions;
+  size_t word_offset = 0;
+  for (size_t slot = 0; slot < merged.terms.size(); ++slot) {
+    const Term& term = merged.terms[slot];
+    if (term.word.empty()) {
+      continue;
+    }
+    auto& docids = merged.term_postings[term.index];
+    SegmentTerm& new_term = new_terms[slot];
+    new_term = {
+      word_offset, buffer.size() - layout.postings, new_skips.size(),
+      static_cast<uint32_t>(term.word.size()), static_cast<uint32_t>(docids.size()),
+      0, numeric_limits<uint8_t>::max()
+    };
+    for (const auto& [docid, hitcount] : docids) {
+      new_term.max_hitcount = max(new_term.max_hitcount, hitcount);
+      new_term.min_length_code = min<uint32_t>(new_term.min_length_code, merged.length_codes[docid]);
+    }
+    copy(term.word.begin(), term.word.end(), buffer.begin() + layout.words + word_offset);
+    word_offset += term.word.size();
+    EncodePostings(docids, buffer, &new_skips, merged.length_codes.data());
+    if (merged.store_positions) {
+      positions_offsets[slot] = new_positions.size();
+      EncodePositions(docids, merged.term_positions[term.index], new_positions);
+      vector<uint32_t>().swap(merged.term_positions[term.index]);
+    }
+    vector<Entry>().swap(docids);
+  }
+  copy_n(reinterpret_cast<const uint8_t*>(new_terms.data()), new_terms.size() * sizeof(SegmentTerm),
+         buffer.begin() + layout.terms);
+
+  if (store_documents) {
+    vector<uint64_t> offsets = {0};
+    auto out = buffer.begin() + layout.documents;
+    for (string_view doc : merged.docs) {
+      out = copy(doc.begin(), doc.end(), out);
+      offsets.push_back(offsets.back() + doc.size());
+    }
+    copy_n(reinterpret_cast<const uint8_t*>(offsets.data()), offsets.size() * sizeof(uint64_t),
+           buffer.begin() + layout.doc_offsets);
+  }
+
+  copy(merged.length_codes.begin(), merged.length_codes.end(), buffer.begin() + layout.length_codes);
+
+  new_header.postings_bytes = buffer.size() - layout.postings;
+  new_header.skips_count = new_skips.size();
+  if (merged.store_positions) {
+    new_header.positions_bytes = positions_offsets.size() * sizeof(uint64_t) + new_positions.size();
+  }
+  buffer.resize(GetLayout(new_header).skips);
+  buffer.insert(
+    buffer.end(), reinterpret_cast<const uint8_t*>(new_skips.data()),
+    reinterpret_cast<const uint8_t*>(new_skips.data() + new_skips.size())
+  );
+  if (merged.store_positions) {
+    buffer.resize(GetLayout(new_header).positions);
+    buffer.insert(
+      buffer.end(), reinterpret_cast<const uint8_t*>(positions_offsets.data()),
+      reinterpret_cast<const uint8_t*>(positions_offsets.data() + positions_offsets.size())
+    );
+    buffer.insert(buffer.end(), new_positions.begin(), new_positions.end());
+  }
+  copy_n(reinterpret_cast<const uint8_t*>(&new_header), sizeof(Header), buffer.begin());
+  buffer.shrink_to_fit();
+
+  auto owned = make_shared<const vector<uint8_t>>(move(buffer));
+  Attach(owned, owned->data(), owned->size());
+}
+
+void InvertedIndex::Attach(shared_ptr<const void> new_storage, const uint8_t* data, size_t size) {
+  if (size < sizeof(Header)) {
+    throw runtime_error("Index segment is truncated");
+  }
+  Header new_header;
+  copy_n(data, sizeof(Header), reinterpret_cast<uint8_t*>(&new_header));
+  if (!equal(begin(SEGMENT_MAGIC), end(SEGMENT_MAGIC), new_header.magic)) {
+    throw runtime_error("Not an index segment");
+  }
+  // Размеры проверяются по отдельности, чтобы их сумма не переполнилась
+  const bool sizes_fit = new_header.term_slots <= size / sizeof(SegmentTerm)
+    && new_header.words_bytes <= size
+    && new_header.doc_count < size / sizeof(uint64_t)
+    && new_header.documents_bytes <= size
+    && new_header.postings_bytes <= size
+    && new_header.skips_count <= size / sizeof(PostingsSkip)
+    && new_header.positions_bytes <= size
+    && (!new_header.has_positions || new_header.positions_bytes >= new_header.term_slots * sizeof(uint64_t));
+  if (!sizes_fit || GetLayout(new_header).end > size
+      || (new_header.term_slots & (new_header.term_slots - 1)) != 0) {
+    throw runtime_error("Index segment is corrupted");
+  }
+
+  const Layout layout = GetLayout(new_header);
+  storage = move(new_storage);
+  segment = data;
+  segment_size = layout.end;
+  header = new_header;
+  terms = reinterpret_cast<const SegmentTerm*>(data + layout.terms);
+  words = reinterpret_cast<const char*>(data + layout.words);
+  doc_offsets = reinterpret_cast<const uint64_t*>(data + layout.doc_offsets);
+  documents = reinterpret_cast<const char*>(data + layout.documents);
+  length_codes = data + layout.length_codes;
+  postings = data + layout.postings;
+  skips = reinterpret_cast<const PostingsSkip*>(data + layout.skips);
+  if (HasPositions()) {
+    positions_offsets = reinterpret_cast<const uint64_t*>(data + layout.positions);
+    positions = data + layout.positions + header.term_slots * sizeof(uint64_t);
+  }
+}
+
+InvertedIndex InvertedIndex::Open(const string& path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw runtime_error("Cannot open index segment " + path);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(fd);
+    throw runtime_error("Cannot open index segment " + path);
+  }
+  const size_t size = file_stat.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw runtime_error("Cannot map index segment " + path);
+  }
+  shared_ptr<const void> mapping(data, [size](const void* data) {
+    munmap(const_cast<void*>(data), size);
+  });
+
+  InvertedIndex index;
+  index.Attach(move(mapping), static_cast<const uint8_t*>(data), size);
+  return index;
+}
+
+void InvertedIndex::Save(const string& path, bool store_documents) const {
+  Header saved_header = header;
+  if (!store_documents) {
+    saved_header.has_documents = 0;
+    saved_header.documents_bytes = 0;
+  }
+  const Layout layout = GetLayout(header);
+  const Layout saved_layout = GetLayout(saved_header);
+
+  ofstream output(path, ios::binary | ios::trunc);
+  size_t written = 0;
+  auto write_section = [&](size_t offset, const void* data, size_t size) {
+    static const char padding[8] = {};
+    output.write(padding, offset - written);
+    output.write(static_cast<const char*>(data), size);
+    written = offset + size;
+  };
+  write_section(0, &saved_header, sizeof(Header));
+  write_section(saved_layout.terms, segment + layout.terms, layout.doc_offsets - layout.terms);
+  write_section(saved_layout.doc_offsets, segment + layout.doc_offsets, saved_layout.length_codes - saved_layout.doc_offsets);
+  write_section(saved_layout.length_codes, length_codes, header.doc_count);
+  write_section(saved_layout.postings, postings, header.postings_bytes);
+  write_section(saved_layout.skips, skips, header.skips_count * sizeof(PostingsSkip));
+  write_section(saved_layout.positions, segment + layout.positions, header.positions_bytes);
+  if (!output.flush()) {
+    throw runtime_error("Cannot write index segment " + path);
+  }
+}
+
+const InvertedIndex::SegmentTerm* InvertedIndex::FindTerm(string_view word) const {
+  if (header.term_slots == 0) {
+    return nullptr;
+  }
+  const size_t mask = header.term_slots - 1;
+  size_t slot = HashWord(word) & mask;
+  while (terms[slot].word_size != 0) {
+    const SegmentTerm& term = terms[slot];
+    if (string_view(words + term.word_offset, term.word_size) == word) {
+      return &term;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return nullptr;
+}
+
+PostingsView InvertedIndex::Lookup(string_view word) const {
+  const SegmentTerm* term = FindTerm(word);
+  if (!term) {
+    return {};
+  }
+  return {
+    postings + term->postings_offset, term->postings_count,
+    term->postings_count > PostingsView::BLOCK_SIZE ? skips + term->skips_offset : nullptr,
+    term->max_hitcount, term->min_length_code
+  };
+}
+
+PositionsView InvertedIndex::LookupPositions(string_view word) const {
+  const SegmentTerm* term = HasPositions() ? FindTerm(word) : nullptr;
+  if (!term) {
+    return {};
+  }
+  return {positions + positions_offsets[term - terms], term->postings_count};
+}
+
+string_view InvertedIndex::GetDocument(size_t docid) const {
+  if (!HasDocuments() || docid >= header.doc_count) {
+    return {};
+  }
+  return {documents + doc_offsets[docid], doc_offsets[docid + 1] - doc_offsets[docid]};
+}
+
+PostingsCursor::PostingsCursor(PostingsView postings)
+  : postings(postings)
+{
+  LoadBlock(0);
+}
+
+void PostingsCursor::LoadBlock(size_t new_block) {
+  block = new_block;
+  position = 0;
+  const size_t first = block * PostingsView::BLOCK_SIZE;
+  if (first >= postings.count) {
+    block_length = 0;
+    docid = END;
+    return;
+  }
+  block_length = min<size_t>(PostingsView::BLOCK_SIZE, postings.count - first);
+
+  const uint8_t* in = postings.data;
+  uint32_t prev_docid = 0;
+  if (block != 0) {
+    in += postings.skips[block - 1].end_offset;
+    prev_docid = postings.skips[block - 1].last_docid;
+  }
+  uint32_t values[4];
+  for (uint32_t i = 0; i < block_length; i += 2) {
+    in = PostingsView::DecodeGroup(in, values);
+    docids[i] = prev_docid += values[0];
+    hitcounts[i] = values[1];
+    if (i + 1 < block_length) {
+      docids[i + 1] = prev_docid += values[2];
+      hitcounts[i + 1] = values[3];
+    }
+  }
+  docid = docids[0];
+}
+
+void PostingsCursor::NextGEQ(uint32_t target) {
+  if (docid >= target) {
+    return;
+  }
+  if (postings.skips && postings.skips[block].last_docid < target) {
+    BlockBound(target);
+    LoadBlock(shallow_block);
+  }
+  while (docid < target) {
+    Next();
+  }
+}
+
+const vector<uint32_t>& PositionsReader::Read(const PostingsCursor& cursor) {
+  if (cursor.block != block || cursor.position < next_position) {
+    const size_t block_count = PositionsBlockCount(positions.count);
+    uint32_t offset = 0;
+    if (block_count != 0) {
+      copy_n(positions.data + cursor.block * sizeof(uint32_t), sizeof(offset), reinterpret_cast<uint8_t*>(&offset));
+    }
+    block = cursor.block;
+    next_position = 0;
+    in = positions.data + block_count * sizeof(uint32_t) + offset;
+  }
+  for (; next_position < cursor.position; ++next_position) {
+    in = SkipVarints(in, cursor.hitcounts[next_position]);
+  }
+  values.resize(cursor.hitcounts[cursor.position]);
+  uint32_t position = 0;
+  for (auto& value : values) {
+    value = position += ReadVarint(in);
+  }
+  ++next_position;
+  return values;
+}
+
+PostingsSkip PostingsCursor::BlockBound(uint32_t target) {
+  if (!postings.skips) {
+    return {0, 0, postings.max_hitcount, postings.min_length_code};
+  }
+  // Цели не убывают, поэтому поиск блока продолжается с прошлого места
+  const size_t block_count = (postings.count + PostingsView::BLOCK_SIZE - 1) / PostingsView::BLOCK_SIZE;
+  shallow_block = max(shallow_block, block);
+  while (shallow_block < block_count && postings.skips[shallow_block].last_docid < target) {
+    ++shallow_block;
+  }
+  return shallow_block < block_count ? postings.skips[shallow_block] : PostingsSkip{0, 0, 0, 0};
+}
+
+InvertedIndex InvertedIndex::Merge(const vector<MergeSource>& sources) {
+  // Слова и документы источников живут в их сегментах, которые
+  // остаются в памяти до конца слияния.
+  Shard merged;
+  merged.store_positions = all_of(sources.begin(), sources.end(), [](const MergeSource& source) {
+    return source.index->HasPositions();
+  });
+  Rehash(merged.terms, 16);
+  bool store_documents = true;
+  vector<uint32_t> positions;
+  for (const auto& [source, deleted] : sources) {
+    const uint32_t first_docid = merged.docs.size();
+    store_documents = store_documents && source->HasDocuments();
+    merged.total_length += source->GetTotalLength();
+    for (uint32_t docid = 0; docid < source->GetDocumentCount(); ++docid) {
+      if (deleted && (*deleted)[docid]) {
+        // Точная длина удалённого документа неизвестна, только её код
+        merged.total_length -= min<uint64_t>(merged.total_length, DecodeDocumentLength(source->length_codes[docid]));
+        merged.docs.emplace_back();
+        merged.length_codes.push_back(0);
+      } else {
+        merged.docs.push_back(source->GetDocument(docid));
+        merged.length_codes.push_back(source->length_codes[docid]);
+      }
+    }
+    for (size_t slot = 0; slot < source->header.term_slots; ++slot) {
+      const SegmentTerm& term = source->terms[slot];
+      if (term.word_size == 0) {
+        continue;
+      }
+      const string_view word(source->words + term.word_offset, term.word_size);
+      // Блоки позиций идут подряд, так что таблица смещений не нужна
+      const uint8_t* positions_in = merged.store_positions
+        ? source->positions + source->positions_offsets[slot] + PositionsBlockCount(term.postings_count) * sizeof(uint32_t)
+        : nullptr;
+      optional<uint32_t> merged_term;
+      PostingsView(source->postings + term.postings_offset, term.postings_count).ForEach(
+        [&](uint32_t docid, uint32_t hitcount) {
+          const bool is_deleted = deleted && (*deleted)[docid];
+          if (positions_in) {
+            positions.clear();
+            for (uint32_t k = 0, position = 0; k < hitcount; ++k) {
+              positions.push_back(position += ReadVarint(positions_in));
+            }
+          }
+          if (is_deleted) {
+            return;
+          }
+          if (!merged_term) {
+            merged_term = AddTerm(merged, word);
+          }
+          merged.term_postings[*merged_term].push_back({first_docid + docid, hitcount});
+          if (positions_in) {
+            auto& term_positions = merged.term_positions[*merged_term];
+            term_positions.insert(term_positions.end(), positions.begin(), positions.end());
+          }
+        }
+      );
+    }
+  }
+
+  InvertedIndex index;
+  index.WriteSegment(merged, store_documents);
+  return index;
+}
+
+SegmentedIndex::SegmentedIndex(InvertedIndex index) {
+  segments.push_back({make_shared<const InvertedIndex>(move(index)), 0, nullptr});
+}
+
+size_t SegmentedIndex::FindSegment(uint32_t docid) const {
+  auto it = upper_bound(segments.begin(), segments.end(), docid, [](uint32_t docid, const Segment& segment) {
+    return docid < segment.first_docid;
+  });
+  return prev(it) - segments.begin();
+}
+
+string_view SegmentedIndex::GetDocument(uint32_t docid) const {
+  if (docid >= GetDocumentCount()) {
+    return {};
+  }
+  const Segment& segment = segments[FindSegment(docid)];
+  return segment.IsDeleted(docid) ? string_view() : segment.index->GetDocument(docid - segment.first_docid);
+}
+
+SegmentedIndex SegmentedIndex::Append(InvertedIndex index) const {
+  SegmentedIndex result = *this;
+  const uint32_t first_docid = GetDocumentCount();
+  result.segments.push_back({make_shared<const InvertedIndex>(move(index)), first_docid, nullptr});
+  return result;
+}
+
+SegmentedIndex SegmentedIndex::Delete(uint32_t docid) const {
+  SegmentedIndex result = *this;
+  if (docid >= GetDocumentCount()) {
+    return result;
+  }
+  Segment& segment = result.segments[FindSegment(docid)];
+  auto deleted = segment.deleted
+    ? make_shared<vector<bool>>(*segment.deleted)
+    : make_shared<vector<bool>>(segment.index->GetDocumentCount());
+  (*deleted)[docid - segment.first_docid] = true;
+  segment.deleted = move(deleted);
+  return result;
+}
+
+SegmentedIndex SegmentedIndex::ReplaceWithMerged(size_t first, size_t last, InvertedIndex merged) const {
+  vector<bool> deleted;
+  bool has_deleted = false;
+  for (size_t i = first; i < last; ++i) {
+    const Segment& segment = segments[i];
+    if (segment.deleted) {
+      deleted.insert(deleted.end(), segment.deleted->begin(), segment.deleted->end());
+      has_deleted = true;
+    } else {
+      deleted.resize(deleted.size() + segment.index->GetDocumentCount());
+    }
+  }
+
+  SegmentedIndex result;
+  result.segments.assign(segments.begin(), segments.begin() + first);
+  result.segments.push_back({
+    make_shared<const InvertedIndex>(move(merged)),
+    segments[first].first_docid,
+    has_deleted ? make_shared<const vector<bool>>(move(deleted)) : nullptr
+  });
+  result.segments.insert(result.segments.end(), segments.begin() + last, segments.end());
+  return result;
+}
+
+optional<pair<size_t, size_t>> SegmentedIndex::PickMerge() const {
+  if (segments.size() < MERGE_FACTOR) {
+    return nullopt;
+  }
+  size_t first = segments.size() - MERGE_FACTOR;
+  size_t merged_size = 0;
+  for (size_t i = first; i < segments.size(); ++i) {
+    merged_size += segments[i].index->GetDocumentCount();
+  }
+  while (first > 0 && segments[first - 1].index->GetDocumentCount() <= merged_size) {
+    --first;
+    merged_size += segments[first].index->GetDocumentCount();
+  }
+  return pair(first, segments.size());
+}
+
+InvertedIndex SegmentedIndex::Merge(size_t first, size_t last) const {
+  vector<InvertedIndex::MergeSource> sources;
+  for (size_t i = first; i < last; ++i) {
+    sources.push_back({segments[i].index.get(), segments[i].deleted.get()});
+  }
+  return InvertedIndex::Merge(sources);
+}
+
+namespace {
+  // Вклад постинга в релевантность документа при ранжировании по hitcount
+  struct HitCountScorer {
+    using Score = size_t;
+
+    Score operator()(uint32_t, uint32_t hitcount) const {
+      return hitcount;
+    }
+  };
+
+  // Вклад постинга по BM25: idf * tf * (k1 + 1) / (tf + K(d)), где K(d)
+  // берётся из таблицы по байтовому коду длины документа
+  struct Bm25Scorer {
+    using Score = float;
+    // Вклады суммируются во float в порядке слов запроса, а оценки
+    // в double в другом порядке, так что отсечение делается с запасом
+    static constexpr double SLACK = 1e-4;
+
+    float weight;
+    const float* length_norms;
+    const uint8_t* length_codes;
+
+    Score operator()(uint32_t docid, uint32_t hitcount) const {
+      return weight * hitcount / (hitcount + length_norms[length_codes[docid]]);
+    }
+
+    // tf / (tf + K) растёт с tf и убывает с K
+    double Bound(uint32_t max_hitcount, uint32_t min_length_code) const {
+      return max_hitcount == 0
+        ? 0.0
+        : double(weight) * max_hitcount / (max_hitcount + double(length_norms[min_length_code]));
+    }
+  };
+
+  // Полный обход дешевле, пока постинги запроса короче нескольких блоков
+  const size_t PRUNING_MIN_POSTINGS = 4 * PostingsView::BLOCK_SIZE;
+
+  const vector<vector<string_view>> NO_PHRASES;
+
+  // Совпадения фразы в виде, который понимает Accumulate
+  struct EntriesPostings {
+    const vector<InvertedIndex::Entry>& entries;
+
+    template <typename Callback>
+    void ForEach(Callback callback) const {
+      for (const auto [docid, hitcount] : entries) {
+        callback(docid, hitcount);
+      }
+    }
+  };
+}
+
+const vector<SearchResult>& QueryEvaluator::Evaluate(
+  const InvertedIndex& index, const vector<string_view>& words, Ranking ranking
+) {
+  segments.assign(1, {&index, 0, nullptr});
+  return EvaluateSegments(index.GetDocumentCount(), words, NO_PHRASES, ranking);
+}
+
+const vector<SearchResult>& QueryEvaluator::Evaluate(
+  const SegmentedIndex& index, const vector<string_view>& words, Ranking ranking
+) {
+  segments.clear();
+  for (const auto& segment : index.GetSegments()) {
+    segments.push_back({segment.index.get(), segment.first_docid, segment.deleted.get()});
+  }
+  return EvaluateSegments(index.GetDocumentCount(), words, NO_PHRASES, ranking);
+}
+
+const vector<SearchResult>& QueryEvaluator::Evaluate(
+  const InvertedIndex& index, const Query& query, Ranking ranking
+) {
+  segments.assign(1, {&index, 0, nullptr});
+  return EvaluateSegments(index.GetDocumentCount(), query.words, query.phrases, ranking);
+}
+
+const vector<SearchResult>& QueryEvaluator::Evaluate(
+  const SegmentedIndex& index, const Query& query, Ranking ranking
 ) {
-  vector<size_t> docid_count;
-  vector<int64_t> docids;
+  segments.clear();
+  for (const auto& segment : index.GetSegments()) {
+    segments.push_back({segment.index.get(), segment.first_docid, segment.deleted.get()});
+  }
+  return EvaluateSegments(index.GetDocumentCount(), query.words, query.phrases, ranking);
+}
+
+const vector<SearchResult>& QueryEvaluator::EvaluateSegments(
+  size_t doc_count, const vector<string_view>& words, const vector<vector<string_view>>& phrases, Ranking ranking
+) {
+  const bool has_positions = all_of(segments.begin(), segments.end(), [](const SegmentRef& segment) {
+    return segment.index->HasPositions();
+  });
+  if (!phrases.empty() && !has_positions) {
+    fallback_words = words;
+    for (const auto& phrase : phrases) {
+      fallback_words.insert(fallback_words.end(), phrase.begin(), phrase.end());
+    }
+    return EvaluateSegments(doc_count, fallback_words, NO_PHRASES, ranking);
+  }
 
-  for (string current_query; getline(query_input, current_query); ) {
-    const auto words = SplitIntoWordsView(current_query);
+  // Между запросами индекс может быть подменён версией с другим
+  // количеством документов. Все счётчики к этому моменту обнулены,
+  // так что достаточно изменить размер векторов.
+  touched.resize(doc_count + 1);
 
-    {
-      auto access = index_handle.GetAccess();
+  phrase_matches.resize(max(phrase_matches.size(), phrases.size() * segments.size()));
+  for (size_t phrase = 0; phrase < phrases.size(); ++phrase) {
+    for (size_t segment = 0; segment < segments.size(); ++segment) {
+      MatchPhrase(*segments[segment].index, phrases[phrase], phrase_matches[phrase * segments.size() + segment]);
+    }
+  }
 
-      // В отличие от однопоточной версии мы должны при каждом обращении
-      // к индексу изменять размер векторов docid_count и docids, потому что
-      // между последовательными итерациями цикла индекс может быть изменён
-      // параллельным запуском функции UpdateIndex. Соответственно в новой
-      // версии базы может быть другое количество документов.
-      const size_t doc_count = access.ref_to_value.GetDocuments().size();
-      docid_count.assign(doc_count, 0);
-      docids.resize(doc_count);
+  // Длинные запросы без фраз считаются параллельно по диапазонам
+  // документов, но только свободными потоками пула: когда пул занят
+  // пакетами запросов, помощники лишь ждали бы в очереди
+  const size_t helpers = pool && phrases.empty() && doc_count >= 2 * MIN_RANGE_DOCS && [&] {
+    size_t total_postings = 0;
+    for (const auto& segment : segments) {
+      for (const auto& word : words) {
+        total_postings += segment.index->Lookup(word).size();
+      }
+    }
+    return total_postings >= PARALLEL_MIN_POSTINGS;
+  }() ? pool->IdleCount() : 0;
 
-      auto& index = access.ref_to_value;
+  // При ранжировании по hitcount больше всех весят самые частые слова,
+  // и оценки сверху почти ничего не отсекают, поэтому MaxScore
+  // применяется только к BM25, где вклад частых слов мал.
+  if (ranking == Ranking::HitCount) {
+    if (helpers > 0) {
+      return ScoreInParallel<HitCountScorer>(doc_count, words, helpers, false, [](size_t, const SegmentRef&) {
+        return HitCountScorer{};
+      });
+    }
+    docid_count.resize(doc_count);
+    for (const auto& segment : segments) {
       for (const auto& word : words) {
-        for (const auto& [docid, hit_count] : index.Lookup(word)) {
-          docid_count[docid] += hit_count;
+        Accumulate(segment, segment.index->Lookup(word), HitCountScorer{}, docid_count);
+      }
+    }
+    for (size_t i = 0; i < phrases.size() * segments.size(); ++i) {
+      Accumulate(segments[i % segments.size()], EntriesPostings{phrase_matches[i]}, HitCountScorer{}, docid_count);
+    }
+    LatencyRecorder::Lap(QueryStage::Lookup);
+    const auto& result = SelectTop(docid_count);
+    LatencyRecorder::Lap(QueryStage::Sort);
+    return result;
+  }
+
+  // IDF и средняя длина документа считаются по всем сегментам,
+  // чтобы релевантность не зависела от того, как разбит индекс
+  docid_score.resize(doc_count);
+  uint64_t total_length = 0;
+  for (const auto& segment : segments) {
+    total_length += segment.index->GetTotalLength();
+  }
+  const float average_length = doc_count ? max(1.0f, float(total_length) / doc_count) : 1.0f;
+  float length_norms[256];
+  for (int code = 0; code < 256; ++code) {
+    length_norms[code] = bm25.k1 * (1 - bm25.b + bm25.b * DecodeDocumentLength(code) / average_length);
+  }
+
+  // doc_freq считается по постингам и включает удалённые, но ещё не
+  // слитые документы: их постинги пропадают только при слиянии. Поэтому
+  // до слияния IDF часто удаляемых слов немного занижен, а с ним и оценки.
+  vector<float> weights;
+  size_t total_postings = 0;
+  for (const auto& word : words) {
+    size_t doc_freq = 0;
+    for (const auto& segment : segments) {
+      doc_freq += segment.index->Lookup(word).size();
+    }
+    const float idf = log1p((doc_count - doc_freq + 0.5) / (doc_freq + 0.5));
+    weights.push_back(idf * (bm25.k1 + 1));
+    total_postings += doc_freq;
+  }
+  // Вес фразы считается так же, по числу документов с ней
+  for (size_t phrase = 0; phrase < phrases.size(); ++phrase) {
+    size_t doc_freq = 0;
+    for (size_t segment = 0; segment < segments.size(); ++segment) {
+      doc_freq += phrase_matches[phrase * segments.size() + segment].size();
+    }
+    const float idf = log1p((doc_count - doc_freq + 0.5) / (doc_freq + 0.5));
+    weights.push_back(idf * (bm25.k1 + 1));
+  }
+
+  // Близость оценивается между разными словами запроса, включая слова фраз
+  vector<string_view> proximity_terms;
+  if (bm25.proximity > 0 && has_positions) {
+    proximity_terms = words;
+    for (const auto& phrase : phrases) {
+      proximity_terms.insert(proximity_terms.end(), phrase.begin(), phrase.end());
+    }
+    sort(proximity_terms.begin(), proximity_terms.end());
+    proximity_terms.erase(unique(proximity_terms.begin(), proximity_terms.end()), proximity_terms.end());
+    if (proximity_terms.size() < 2) {
+      proximity_terms.clear();
+    }
+  }
+
+  const bool prune = pruning && total_postings >= PRUNING_MIN_POSTINGS && phrases.empty() && proximity_terms.empty();
+  if (helpers > 0 && proximity_terms.empty()) {
+    // С pruning каждый диапазон обходится MaxScore, и диапазоны отсекают
+    // документы по общей для всех пятой оценке
+    return ScoreInParallel<Bm25Scorer>(doc_count, words, helpers, prune, [&](size_t word, const SegmentRef& segment) {
+      return Bm25Scorer{weights[word], length_norms, segment.index->GetLengthCodes()};
+    });
+  }
+  if (prune) {
+    top.clear();
+    vector<Bm25Scorer> scorers;
+    for (const auto& segment : segments) {
+      scorers.clear();
+      for (float weight : weights) {
+        scorers.push_back({weight, length_norms, segment.index->GetLengthCodes()});
+      }
+      PruneSegment(segment, words, scorers);
+    }
+    LatencyRecorder::Lap(QueryStage::Lookup);
+    const auto& result = SortTop<float>();
+    LatencyRecorder::Lap(QueryStage::Sort);
+    return result;
+  }
+  for (size_t i = 0; i < words.size(); ++i) {
+    for (const auto& segment : segments) {
+      const Bm25Scorer scorer = {weights[i], length_norms, segment.index->GetLengthCodes()};
+      Accumulate(segment, segment.index->Lookup(words[i]), scorer, docid_score);
+    }
+  }
+  for (size_t i = 0; i < phrases.size() * segments.size(); ++i) {
+    const SegmentRef& segment = segments[i % segments.size()];
+    const Bm25Scorer scorer = {weights[words.size() + i / segments.size()], length_norms, segment.index->GetLengthCodes()};
+    Accumulate(segment, EntriesPostings{phrase_matches[i]}, scorer, docid_score);
+  }
+  LatencyRecorder::Lap(QueryStage::Lookup);
+  const auto& result = proximity_terms.empty()
+    ? SelectTop(docid_score)
+    : SelectTopByProximity(docid_score, proximity_terms);
+  LatencyRecorder::Lap(QueryStage::Sort);
+  return result;
+}
+
+void QueryEvaluator::MatchPhrase(
+  const InvertedIndex& index, const vector<string_view>& phrase, vector<InvertedIndex::Entry>& matches
+) {
+  matches.clear();
+  term_cursors.clear();
+  term_readers.clear();
+  for (const auto word : phrase) {
+    const PostingsView postings = index.Lookup(word);
+    if (postings.size() == 0) {
+      return;
+    }
+    term_cursors.emplace_back(postings);
+    term_readers.emplace_back(index.LookupPositions(word));
+  }
+
+  // Документы со всеми словами фразы ищутся переходами NextGEQ,
+  // и только для них читаются позиции
+  vector<const vector<uint32_t>*> positions(phrase.size());
+  uint32_t candidate = term_cursors[0].Docid();
+  while (candidate != PostingsCursor::END) {
+    size_t word = 1;
+    for (; word < phrase.size(); ++word) {
+      term_cursors[word].NextGEQ(candidate);
+      if (term_cursors[word].Docid() != candidate) {
+        break;
+      }
+    }
+    if (word < phrase.size()) {
+      term_cursors[0].NextGEQ(term_cursors[word].Docid());
+      candidate = term_cursors[0].Docid();
+      continue;
+    }
+
+    for (size_t i = 0; i < phrase.size(); ++i) {
+      positions[i] = &term_readers[i].Read(term_cursors[i]);
+    }
+    uint32_t count = 0;
+    for (const uint32_t start : *positions[0]) {
+      bool matched = true;
+      for (size_t i = 1; matched && i < phrase.size(); ++i) {
+        matched = binary_search(positions[i]->begin(), positions[i]->end(), start + i);
+      }
+      count += matched;
+    }
+    if (count != 0) {
+      matches.push_back({candidate, count});
+    }
+    term_cursors[0].Next();
+    candidate = term_cursors[0].Docid();
+  }
+}
+
+template <typename Scorer, typename Postings>
+void QueryEvaluator::Accumulate(
+  const SegmentRef& segment, const Postings& postings, Scorer scorer, vector<typename Scorer::Score>& scores
+) {
+  // Документ попадает в touched без ветвления: номер пишется всегда,
+  // а счётчик сдвигается, только если документ встретился впервые
+  auto add = [&](uint32_t docid, uint32_t hitcount) {
+    const uint32_t global_docid = segment.first_docid + docid;
+    touched[touched_count] = global_docid;
+    touched_count += scores[global_docid] == 0;
+    scores[global_docid] += scorer(docid, hitcount);
+  };
+  if (segment.deleted) {
+    postings.ForEach([&](uint32_t docid, uint32_t hitcount) {
+      if (!(*segment.deleted)[docid]) {
+        add(docid, hitcount);
+      }
+    });
+  } else {
+    postings.ForEach(add);
+  }
+}
+
+template <typename Scorer>
+void QueryEvaluator::PruneSegment(
+  const SegmentRef& segment, const vector<string_view>& words, const vector<Scorer>& scorers,
+  uint32_t begin, uint32_t end, atomic<double>* shared_threshold
+) {
+  using Score = typename Scorer::Score;
+
+  pruning_terms.clear();
+  for (size_t word = 0; word < words.size(); ++word) {
+    const PostingsView postings = segment.index->Lookup(words[word]);
+    if (postings.size() != 0) {
+      const double bound = scorers[word].Bound(postings.MaxHitcount(), postings.MinLengthCode());
+      pruning_terms.push_back({PostingsCursor(postings), bound, word});
+      if (begin > 0) {
+        pruning_terms.back().cursor.NextGEQ(begin);
+      }
+    }
+  }
+  sort(pruning_terms.begin(), pruning_terms.end(), [](const PruningTerm& lhs, const PruningTerm& rhs) {
+    return lhs.bound < rhs.bound;
+  });
+  bound_prefix.clear();
+  for (const auto& term : pruning_terms) {
+    bound_prefix.push_back((bound_prefix.empty() ? 0 : bound_prefix.back()) + term.bound);
+  }
+  contributions.assign(words.size(), 0);
+
+  auto fifth_score = [this]() -> double {
+    if constexpr (is_same_v<Score, size_t>) {
+      return top.front().hitcount;
+    } else {
+      return top.front().score;
+    }
+  };
+  // Документ войдёт в пятёрку, только если его релевантность строго
+  // больше худшей из пяти: при равенстве выигрывает меньший номер,
+  // а документы обходятся по возрастанию номеров. Общую пятую оценку
+  // мог дать документ с большим номером, поэтому по ней отсекаются
+  // только строго худшие.
+  auto cannot_enter = [&](double upper_bound) {
+    upper_bound *= 1 + Scorer::SLACK;
+    if (shared_threshold && upper_bound < shared_threshold->load(memory_order_relaxed)) {
+      return true;
+    }
+    return top.size() == 5 && upper_bound <= fifth_score();
+  };
+  // Слова [0, first_essential) вместе не дают войти в пятёрку
+  auto count_non_essential = [&] {
+    size_t count = 0;
+    while (count < bound_prefix.size() && cannot_enter(bound_prefix[count])) {
+      ++count;
+    }
+    return count;
+  };
+
+  for (size_t first_essential = count_non_essential(); first_essential < pruning_terms.size(); ) {
+    uint32_t docid = PostingsCursor::END;
+    for (size_t i = first_essential; i < pruning_terms.size(); ++i) {
+      docid = min(docid, pruning_terms[i].cursor.Docid());
+    }
+    if (docid >= end) {
+      break;
+    }
+
+    double partial = 0;
+    for (size_t i = first_essential; i < pruning_terms.size(); ++i) {
+      auto& [cursor, bound, word] = pruning_terms[i];
+      if (cursor.Docid() == docid) {
+        contributions[word] = scorers[word](docid, cursor.Hitcount());
+        partial += contributions[word];
+        cursor.Next();
+      }
+    }
+
+    bool pruned = segment.deleted && (*segment.deleted)[docid];
+    for (size_t i = first_essential; i-- > 0 && !pruned; ) {
+      auto& [cursor, bound, word] = pruning_terms[i];
+      const PostingsSkip block = cursor.BlockBound(docid);
+      const double block_bound = scorers[word].Bound(block.max_hitcount, block.min_length_code);
+      if (cannot_enter(partial + bound_prefix[i]) || cannot_enter(partial + block_bound + (i ? bound_prefix[i - 1] : 0))) {
+        pruned = true;
+        break;
+      }
+      cursor.NextGEQ(docid);
+      if (cursor.Docid() == docid) {
+        contributions[word] = scorers[word](docid, cursor.Hitcount());
+        partial += contributions[word];
+      }
+    }
+
+    if (!pruned) {
+      // Сумма в порядке слов запроса, как при полном обходе
+      Score score = 0;
+      for (double contribution : contributions) {
+        score += static_cast<Score>(contribution);
+      }
+      SearchResult candidate = {segment.first_docid + docid, 0};
+      if constexpr (is_same_v<Score, size_t>) {
+        candidate.hitcount = score;
+      } else {
+        candidate.score = score;
+      }
+      Offer<Score>(candidate);
+      if (shared_threshold && top.size() == 5) {
+        // Пятая оценка диапазона не выше пятой в общем ответе
+        const double fifth = fifth_score();
+        double current = shared_threshold->load(memory_order_relaxed);
+        while (current < fifth && !shared_threshold->compare_exchange_weak(current, fifth, memory_order_relaxed)) {
         }
       }
+      first_essential = count_non_essential();
+    }
+    fill(contributions.begin(), contributions.end(), 0);
+  }
+}
+
+namespace {
+  // Лучше тот, у кого больше релевантность, а при равенстве меньше номер
+  template <typename Score>
+  bool IsBetter(const SearchResult& lhs, const SearchResult& rhs) {
+    if constexpr (is_same_v<Score, size_t>) {
+      return pair(lhs.hitcount, rhs.docid) > pair(rhs.hitcount, lhs.docid);
+    } else {
+      return pair(lhs.score, rhs.docid) > pair(rhs.score, lhs.docid);
+    }
+  }
+
+  // Куча из не более чем пяти лучших документов, на вершине худший из них
+  template <typename Score>
+  void OfferTo(vector<SearchResult>& top, const SearchResult& candidate) {
+    if (top.size() < 5) {
+      top.push_back(candidate);
+      push_heap(top.begin(), top.end(), IsBetter<Score>);
+    } else if (IsBetter<Score>(candidate, top.front())) {
+      pop_heap(top.begin(), top.end(), IsBetter<Score>);
+      top.back() = candidate;
+      push_heap(top.begin(), top.end(), IsBetter<Score>);
+    }
+  }
+}
+
+template <typename Score>
+void QueryEvaluator::Offer(const SearchResult& candidate) {
+  OfferTo<Score>(top, candidate);
+}
+
+template <typename Score>
+const vector<SearchResult>& QueryEvaluator::SortTop() {
+  sort_heap(top.begin(), top.end(), IsBetter<Score>);
+  return top;
+}
+
+template <typename Score>
+const vector<SearchResult>& QueryEvaluator::SelectTop(vector<Score>& scores) {
+  top.clear();
+  for (size_t i = 0; i < touched_count; ++i) {
+    const uint32_t docid = touched[i];
+    SearchResult candidate = {docid, 0};
+    if constexpr (is_same_v<Score, size_t>) {
+      candidate.hitcount = scores[docid];
+    } else {
+      candidate.score = scores[docid];
     }
+    Offer<Score>(candidate);
+    scores[docid] = 0;
+  }
+  touched_count = 0;
+  return SortTop<Score>();
+}
+
+const vector<SearchResult>& QueryEvaluator::SelectTopByProximity(
+  vector<float>& scores, const vector<string_view>& terms
+) {
+  auto& candidates = rerank_candidates;
+  candidates.clear();
+  for (size_t i = 0; i < touched_count; ++i) {
+    const uint32_t docid = touched[i];
+    candidates.push_back({docid, 0, scores[docid]});
+    scores[docid] = 0;
+  }
+  touched_count = 0;
+  if (candidates.size() > RERANK_DEPTH) {
+    nth_element(candidates.begin(), candidates.begin() + RERANK_DEPTH, candidates.end(), IsBetter<float>);
+    candidates.resize(RERANK_DEPTH);
+  }
+  sort(candidates.begin(), candidates.end(), [](const SearchResult& lhs, const SearchResult& rhs) {
+    return lhs.docid < rhs.docid;
+  });
 
-    iota(docids.begin(), docids.end(), 0);
-    {
-      partial_sort(
-        begin(docids),
-        Head(docids, 5).end(),
-        end(docids),
-        [&docid_count](int64_t lhs, int64_t rhs) {
-          return pair(docid_count[lhs], -lhs) > pair(docid_count[rhs], -rhs);
+  // Близость — сумма 1/d^2 по соседним вхождениям разных слов запроса
+  // на расстоянии d, а прибавка к релевантности растёт с ней до
+  // bm25.proximity. Кандидаты обходятся по возрастанию номеров, так что
+  // курсоры слов в каждом сегменте движутся только вперёд.
+  auto candidate = candidates.begin();
+  for (const auto& segment : segments) {
+    const uint32_t segment_end = segment.first_docid + segment.index->GetDocumentCount();
+    if (candidate == candidates.end() || candidate->docid >= segment_end) {
+      continue;
+    }
+    term_cursors.clear();
+    term_readers.clear();
+    for (const auto term : terms) {
+      term_cursors.emplace_back(segment.index->Lookup(term));
+      term_readers.emplace_back(segment.index->LookupPositions(term));
+    }
+    for (; candidate != candidates.end() && candidate->docid < segment_end; ++candidate) {
+      const uint32_t docid = candidate->docid - segment.first_docid;
+      term_positions.clear();
+      for (uint32_t term = 0; term < terms.size(); ++term) {
+        term_cursors[term].NextGEQ(docid);
+        if (term_cursors[term].Docid() == docid) {
+          for (const uint32_t position : term_readers[term].Read(term_cursors[term])) {
+            term_positions.push_back({position, term});
+          }
         }
-      );
+      }
+      sort(term_positions.begin(), term_positions.end());
+      double proximity = 0;
+      for (size_t i = 1; i < term_positions.size(); ++i) {
+        if (term_positions[i].second != term_positions[i - 1].second) {
+          const double distance = term_positions[i].first - term_positions[i - 1].first;
+          proximity += 1 / (distance * distance);
+        }
+      }
+      candidate->score += bm25.proximity * proximity / (1 + proximity);
     }
+  }
 
-    search_results_output << current_query << ':';
-    for (size_t docid : Head(docids, 5)) {
-      const size_t hit_count = docid_count[docid];
-      if (hit_count == 0) {
-        break;
+  top.clear();
+  for (const auto& result : candidates) {
+    Offer<float>(result);
+  }
+  return SortTop<float>();
+}
+
+// Общее состояние параллельного подсчёта одного запроса. Потоки пула,
+// до которых очередь дошла слишком поздно, видят, что диапазоны
+// кончились, и сразу выходят, поэтому состояние живёт в shared_ptr.
+template <typename Scorer>
+struct QueryEvaluator::RangeScoring {
+  using Score = typename Scorer::Score;
+
+  struct Term {
+    PostingsView postings;
+    Scorer scorer;
+  };
+
+  vector<SegmentRef> segments;
+  // Слова запроса по сегментам в порядке запроса, чтобы оценки BM25
+  // складывались в том же порядке, что и при подсчёте в одном потоке
+  vector<vector<Term>> terms;
+  // Для обхода MaxScore: оценщики всех слов запроса по сегментам
+  // и пятая оценка, лучшая из найденных во всех диапазонах
+  bool prune = false;
+  vector<string_view> words;
+  vector<vector<Scorer>> scorers;
+  atomic<double> threshold = 0;
+  size_t doc_count = 0;
+  size_t range_size = 0;
+  size_t range_count = 0;
+  vector<vector<SearchResult>> range_tops;
+
+  atomic<size_t> next_range = 0;
+  atomic<size_t> done_ranges = 0;
+  mutex m;
+  condition_variable all_done;
+
+  void Run() {
+    for (size_t range; (range = next_range.fetch_add(1)) < range_count; ) {
+      if constexpr (is_same_v<Scorer, Bm25Scorer>) {
+        if (prune) {
+          PruneRange(range);
+        }
+      }
+      if (!prune) {
+        ScoreRange(range);
       }
+      if (done_ranges.fetch_add(1) + 1 == range_count) {
+        lock_guard guard(m);
+        all_done.notify_all();
+      }
+    }
+  }
 
-      search_results_output << " {"
-          << "docid: " << docid << ", "
-          << "hitcount: " << hit_count << '}';
+  // Номера документов сегмента, попадающих в диапазон; пустой
+  // промежуток, если они не пересекаются
+  pair<uint32_t, uint32_t> LocalRange(const SegmentRef& segment, size_t range) const {
+    const uint32_t range_begin = range * range_size;
+    const uint32_t range_end = min(doc_count, range_begin + range_size);
+    const uint32_t segment_end = segment.first_docid + segment.index->GetDocumentCount();
+    if (segment_end <= range_begin || segment.first_docid >= range_end) {
+      return {0, 0};
     }
-    search_results_output << '\n';
+    return {max(range_begin, segment.first_docid) - segment.first_docid, min(range_end, segment_end) - segment.first_docid};
+  }
+
+  void PruneRange(size_t range) {
+    // Обход MaxScore хранит состояние в полях вычислителя,
+    // поэтому у каждого потока свой
+    thread_local QueryEvaluator evaluator;
+    evaluator.top.clear();
+    for (size_t i = 0; i < segments.size(); ++i) {
+      if (const auto [local_begin, local_end] = LocalRange(segments[i], range); local_begin < local_end) {
+        evaluator.PruneSegment(segments[i], words, scorers[i], local_begin, local_end, &threshold);
+      }
+    }
+    range_tops[range] = evaluator.top;
+  }
+
+  void ScoreRange(size_t range) {
+    thread_local vector<Score> scores;
+    const uint32_t range_begin = range * range_size;
+    const uint32_t range_end = min(doc_count, range_begin + range_size);
+    scores.assign(range_end - range_begin, 0);
+
+    for (size_t i = 0; i < segments.size(); ++i) {
+      const SegmentRef& segment = segments[i];
+      const auto [local_begin, local_end] = LocalRange(segment, range);
+      if (local_begin == local_end) {
+        continue;
+      }
+      // Оценки документов сегмента с номерами от local_begin; сегмент
+      // может начинаться раньше диапазона, поэтому смещение берётся
+      // от local_begin, чтобы указатель не выходил за scores
+      Score* segment_scores = scores.data() + (segment.first_docid + local_begin - range_begin);
+      for (const auto& [postings, scorer] : terms[i]) {
+        PostingsCursor cursor(postings);
+        for (cursor.NextGEQ(local_begin); cursor.Docid() < local_end; cursor.Next()) {
+          if (!segment.deleted || !(*segment.deleted)[cursor.Docid()]) {
+            segment_scores[cursor.Docid() - local_begin] += scorer(cursor.Docid(), cursor.Hitcount());
+          }
+        }
+      }
+    }
+
+    auto& top = range_tops[range];
+    for (uint32_t docid = range_begin; docid < range_end; ++docid) {
+      if (const Score score = scores[docid - range_begin]; score != 0) {
+        SearchResult candidate = {docid, 0};
+        if constexpr (is_same_v<Score, size_t>) {
+          candidate.hitcount = score;
+        } else {
+          candidate.score = score;
+        }
+        OfferTo<Score>(top, candidate);
+      }
+    }
+  }
+};
+
+template <typename Scorer, typename MakeScorer>
+const vector<SearchResult>& QueryEvaluator::ScoreInParallel(
+  size_t doc_count, const vector<string_view>& words, size_t helpers, bool prune, MakeScorer make_scorer
+) {
+  using Score = typename Scorer::Score;
+
+  auto job = make_shared<RangeScoring<Scorer>>();
+  job->segments = segments;
+  job->prune = prune;
+  if (prune) {
+    job->words = words;
+    job->scorers.resize(segments.size());
+  } else {
+    job->terms.resize(segments.size());
+  }
+  for (size_t i = 0; i < segments.size(); ++i) {
+    for (size_t word = 0; word < words.size(); ++word) {
+      const PostingsView postings = segments[i].index->Lookup(words[word]);
+      if (prune) {
+        job->scorers[i].push_back(make_scorer(word, segments[i]));
+      } else if (postings.size() != 0) {
+        job->terms[i].push_back({postings, make_scorer(word, segments[i])});
+      }
+    }
+  }
+  // Диапазонов в несколько раз больше, чем потоков, чтобы потоки,
+  // которым достались короткие постинги, успели помочь остальным
+  job->doc_count = doc_count;
+  job->range_count = min((doc_count + MIN_RANGE_DOCS - 1) / MIN_RANGE_DOCS, 4 * (helpers + 1));
+  job->range_size = (doc_count + job->range_count - 1) / job->range_count;
+  job->range_tops.resize(job->range_count);
+
+  for (size_t helper = 0; helper < min(helpers, job->range_count - 1); ++helper) {
+    pool->Submit([job] {
+      job->Run();
+    });
+  }
+  // Вызывающий поток сам считает диапазоны и ждёт только те, что уже
+  // забрали другие потоки, так что занятый пул не приводит к взаимной
+  // блокировке
+  job->Run();
+  {
+    unique_lock lock(job->m);
+    job->all_done.wait(lock, [&job] {
+      return job->done_ranges == job->range_count;
+    });
+  }
+  LatencyRecorder::Lap(QueryStage::Lookup);
+
+  top.clear();
+  for (const auto& range_top : job->range_tops) {
+    for (const auto& result : range_top) {
+      Offer<Score>(result);
+    }
+  }
+  const auto& result = SortTop<Score>();
+  LatencyRecorder::Lap(QueryStage::Sort);
+  return result;
+}
+
+namespace {
+  const size_t QUERY_BATCH_SIZE = 256;
+
+  // Числа форматируются to_chars прямо в буфер ответа, минуя ostream;
+  // float — как operator<< по умолчанию, с шестью значащими цифрами.
+  template <typename Number>
+  void AppendNumber(string& out, Number value) {
+    char buffer[32];
+    const auto [end, error] = [&] {
+      if constexpr (is_floating_point_v<Number>) {
+        return to_chars(begin(buffer), std::end(buffer), value, chars_format::general, 6);
+      } else {
+        return to_chars(begin(buffer), std::end(buffer), value);
+      }
+    }();
+    out.append(buffer, end);
+  }
+
+  void AppendResults(string& out, const vector<SearchResult>& top, Ranking ranking) {
+    for (const auto& result : top) {
+      out += " {docid: ";
+      AppendNumber(out, result.docid);
+      if (ranking == Ranking::HitCount) {
+        out += ", hitcount: ";
+        AppendNumber(out, result.hitcount);
+      } else {
+        out += ", score: ";
+        AppendNumber(out, result.score);
+      }
+      out += '}';
+    }
+  }
+
+  string ProcessQueryBatch(
+    const vector<string>& queries,
+    const Snapshot<SegmentedIndex>& index_handle,
+    Ranking ranking,
+    bool parse_phrases,
+    QueryCache& cache,
+    LatencyRecorder& latencies,
+    ThreadPool& pool
+  ) {
+    thread_local QueryEvaluator evaluator;
+    thread_local Query query;
+    thread_local string key;
+    // Размер ответа на предыдущий пакет этого потока, чтобы сразу
+    // выделить буфер нужной длины
+    thread_local size_t last_output_size = 0;
+
+    // Пакет работает с неизменяемой версией индекса, которую
+    // UpdateDocumentBase и слияния не трогают, а лишь подменяет новой.
+    const auto index = index_handle.Get();
+    latencies.AttachThread();
+    evaluator.SetThreadPool(&pool);
+
+    string output;
+    output.reserve(last_output_size + last_output_size / 8);
+    for (const auto& current_query : queries) {
+      LatencyRecorder::StartQuery();
+      output += current_query;
+      output += ':';
+
+      // Релевантность — сумма по словам и фразам запроса, поэтому запросы
+      // из одних и тех же слов и фраз (с учётом повторов) в любом порядке
+      // дают один ответ. Они всегда суммируются в отсортированном порядке,
+      // чтобы и оценки BM25 в float не зависели от порядка в запросе.
+      // При разборе фраз слова не начинаются с кавычки, а слова фраз ею
+      // не кончаются, так что фразы в ключе не спутать со словами.
+      ParseQuery(current_query, query, parse_phrases);
+      sort(query.words.begin(), query.words.end());
+      sort(query.phrases.begin(), query.phrases.end());
+      key.clear();
+      for (const auto word : query.words) {
+        key.append(word.data(), word.size());
+        key.push_back(' ');
+      }
+      for (const auto& phrase : query.phrases) {
+        key.push_back('"');
+        for (const auto word : phrase) {
+          key.append(word.data(), word.size());
+          key.push_back(' ');
+        }
+        key += "\" ";
+      }
+      LatencyRecorder::Lap(QueryStage::Split);
+
+      if (auto cached = cache.Get(key, index->GetGeneration())) {
+        LatencyRecorder::Lap(QueryStage::Lookup);
+        output += *cached;
+      } else {
+        const auto& top = evaluator.Evaluate(*index, query, ranking);
+        const size_t answer_begin = output.size();
+        AppendResults(output, top, ranking);
+        if (cache.IsEnabled()) {
+          cache.Put(key, output.substr(answer_begin), index->GetGeneration());
+        }
+      }
+      output += '\n';
+      LatencyRecorder::Lap(QueryStage::Output);
+      LatencyRecorder::FinishQuery();
+    }
+    last_output_size = output.size();
+    return output;
+  }
+}
+
+void ProcessSearches(
+  istream& query_input,
+  ostream& search_results_output,
+  const Snapshot<SegmentedIndex>& index_handle,
+  Ranking ranking,
+  bool parse_phrases,
+  QueryCache& cache,
+  LatencyRecorder& latencies,
+  ThreadPool& pool
+) {
+  // Запросы разбиваются на пакеты, которые обрабатываются в пуле
+  // параллельно, а результаты выводятся в исходном порядке. Число
+  // пакетов в работе ограничено, чтобы не читать весь поток в память.
+  // Каждый пакет выводится целиком одним write.
+  const size_t max_batches_in_flight = 2 * pool.Size();
+  deque<future<string>> batches;
+  auto write_front = [&batches, &search_results_output] {
+    const string output = batches.front().get();
+    search_results_output.write(output.data(), output.size());
+    batches.pop_front();
+  };
+  while (query_input) {
+    vector<string> queries;
+    queries.reserve(QUERY_BATCH_SIZE);
+    for (string current_query; queries.size() < QUERY_BATCH_SIZE && getline(query_input, current_query); ) {
+      queries.push_back(move(current_query));
+    }
+    if (queries.empty()) {
+      break;
+    }
+
+    batches.push_back(pool.Submit([queries = move(queries), &index_handle, ranking, parse_phrases, &cache, &latencies, &pool] {
+      return ProcessQueryBatch(queries, index_handle, ranking, parse_phrases, cache, latencies, pool);
+    }));
+    if (batches.size() >= max_batches_in_flight) {
+      write_front();
+    }
+  }
+  while (!batches.empty()) {
+    write_front();
+  }
+}
+
+InvertedIndex SearchServer::BuildIndex(istream& document_input, bool store_positions, size_t threads) {
+  return InvertedIndex(document_input, 1 << 22, threads, true, store_positions);
+}
+
+void SearchServer::Publish(SegmentedIndex new_index) {
+  new_index.SetGeneration(++last_generation);
+  index.Set(move(new_index));
+}
+
+void SearchServer::Wait() {
+  FinishRebuild();
+  // Задача убирается из списка до get(), чтобы после исключения
+  // в списке не осталось уже прочитанных future
+  while (!async_tasks.empty()) {
+    future<void> task = move(async_tasks.front());
+    async_tasks.erase(async_tasks.begin());
+    task.get();
+  }
+}
+
+void SearchServer::RemoveFinishedTasks() {
+  for (size_t i = 0; i < async_tasks.size(); ) {
+    if (async_tasks[i].wait_for(0s) == future_status::ready) {
+      future<void> task = move(async_tasks[i]);
+      async_tasks.erase(async_tasks.begin() + i);
+      task.get();
+    } else {
+      ++i;
+    }
+  }
+}
+
+void SearchServer::FinishRebuild() {
+  if (pending_rebuild.valid()) {
+    pending_rebuild.get();
   }
 }
 
 void SearchServer::UpdateDocumentBase(istream& document_input) {
-  async_tasks.push_back(async(UpdateIndex, ref(document_input), ref(index)));
+  RemoveFinishedTasks();
+  // Предыдущая перестройка дорабатывает среди остальных задач; если она
+  // закончится позже этой, её результат уже устарел и отбрасывается
+  if (pending_rebuild.valid()) {
+    async_tasks.push_back(move(pending_rebuild));
+  }
+  const uint64_t rebuild = ++rebuild_requests;
+  pending_rebuild = async(launch::async, [this, &document_input, rebuild] {
+    SegmentedIndex new_index(BuildIndex(document_input, store_positions));
+    lock_guard lock(update_mutex);
+    if (rebuild > published_rebuild) {
+      published_rebuild = rebuild;
+      Publish(move(new_index));
+    }
+  });
+}
+
+uint32_t SearchServer::AddDocuments(istream& document_input) {
+  FinishRebuild();
+  InvertedIndex segment = BuildIndex(document_input, store_positions, 1);
+  uint32_t first_docid;
+  {
+    lock_guard lock(update_mutex);
+    const auto current = index.Get();
+    first_docid = current->GetDocumentCount();
+    if (segment.GetDocumentCount() == 0) {
+      return first_docid;
+    }
+    Publish(current->Append(move(segment)));
+  }
+  ScheduleMerge();
+  return first_docid;
+}
+
+void SearchServer::DeleteDocument(uint32_t docid) {
+  FinishRebuild();
+  lock_guard lock(update_mutex);
+  Publish(index.Get()->Delete(docid));
+}
+
+void SearchServer::ScheduleMerge() {
+  RemoveFinishedTasks();
+  if (!merge_running.exchange(true)) {
+    async_tasks.push_back(async(launch::async, &SearchServer::MergeSegments, this));
+  }
+}
+
+void SearchServer::MergeSegments() {
+  try {
+    do {
+      MergeWhilePossible();
+      merge_running = false;
+      // AddDocuments, опубликовавший сегмент после последней проверки
+      // PickMerge, видел флаг ещё поднятым и слияние не запустил, поэтому
+      // перед выходом набор проверяется снова
+    } while (index.Get()->PickMerge() && !merge_running.exchange(true));
+  } catch (...) {
+    // Иначе после ошибки слияния новые уже никогда бы не запускались
+    merge_running = false;
+    throw;
+  }
+}
+
+void SearchServer::MergeWhilePossible() {
+  // Слияние идёт без блокировки по неизменяемой версии набора; результат
+  // публикуется, только если сливаемые сегменты всё ещё на месте, ведь
+  // UpdateDocumentBase мог тем временем заменить индекс целиком.
+  for (auto snapshot = index.Get(); auto range = snapshot->PickMerge(); snapshot = index.Get()) {
+    const auto [first, last] = *range;
+    InvertedIndex merged = snapshot->Merge(first, last);
+
+    lock_guard lock(update_mutex);
+    const auto current = index.Get();
+    const auto& old_segments = snapshot->GetSegments();
+    const auto& new_segments = current->GetSegments();
+    const bool unchanged = new_segments.size() >= last && equal(
+      old_segments.begin() + first, old_segments.begin() + last, new_segments.begin() + first,
+      [](const SegmentedIndex::Segment& lhs, const SegmentedIndex::Segment& rhs) {
+        return lhs.index == rhs.index;
+      }
+    );
+    if (unchanged) {
+      Publish(current->ReplaceWithMerged(first, last, move(merged)));
+    }
+  }
+}
+
+void SearchServer::LoadIndex(const string& path) {
+  FinishRebuild();
+  SegmentedIndex new_index(InvertedIndex::Open(path));
+  lock_guard lock(update_mutex);
+  Publish(move(new_index));
+}
+
+void SearchServer::SaveIndex(const string& path) const {
+  const auto current = index.Get();
+  const auto& segments = current->GetSegments();
+  if (segments.size() == 1 && !segments.front().deleted) {
+    segments.front().index->Save(path);
+  } else {
+    current->Merge(0, segments.size()).Save(path);
+  }
 }
 
 void SearchServer::AddQueriesStream(
   istream& query_input, ostream& search_results_output
 ) {
+  RemoveFinishedTasks();
   async_tasks.push_back(
     async(
-      ProcessSearches, ref(query_input), ref(search_results_output), ref(index)
+      launch::async, ProcessSearches,
+      ref(query_input), ref(search_results_output), cref(index), ranking, store_positions,
+      ref(cache), ref(latencies), ref(pool)
     )
   );
-}
\ No newline at end of file
+}
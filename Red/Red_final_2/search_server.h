@@ -1,51 +1,675 @@
 #pragma once
 
 #include "search_server.h"
-#include "synchronized.h"
+#include "parse.h"
+#include "snapshot.h"
+#include "query_cache.h"
+#include "profile_advanced.h"
+#include "thread_pool.h"
+#include "iterator_range.h"
 
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <deque>
 #include <istream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <atomic>
 #include <ostream>
 #include <vector>
 #include <string>
 #include <string_view>
 #include <queue>
 #include <future>
-#include <map>
+#include <thread>
 using namespace std;
 
+// Запись таблицы переходов по постингам слова. Постинги делятся на блоки
+// по PostingsView::BLOCK_SIZE, и для каждого блока хранится номер его
+// последнего документа, смещение конца блока от начала постингов слова,
+// а также наибольший hitcount и наименьший код длины документа в блоке,
+// по которым оценивается сверху вклад блока в релевантность.
+struct PostingsSkip {
+  uint32_t last_docid;
+  uint32_t end_offset;
+  uint32_t max_hitcount;
+  uint32_t min_length_code;
+};
+
+// Постинги слова в сжатом виде: номера документов хранятся разностями
+// с предыдущим номером, а пары (разность, hitcount) упакованы группами
+// по четыре числа в духе StreamVByte: управляющий байт содержит длины
+// четырёх чисел (по 2 бита), за ним идут сами числа по 1-4 байта.
+// Таблица переходов есть только у списков длиннее одного блока.
+class PostingsView {
+public:
+  static constexpr uint32_t BLOCK_SIZE = 64;
+
+  PostingsView() = default;
+  PostingsView(
+    const uint8_t* data, uint32_t count, const PostingsSkip* skips = nullptr,
+    uint32_t max_hitcount = numeric_limits<uint32_t>::max(), uint32_t min_length_code = 0
+  )
+    : data(data), count(count), skips(skips), max_hitcount(max_hitcount), min_length_code(min_length_code)
+  {
+  }
+
+  size_t size() const {
+    return count;
+  }
+
+  // Оценка сверху для всех постингов слова
+  uint32_t MaxHitcount() const {
+    return max_hitcount;
+  }
+
+  uint32_t MinLengthCode() const {
+    return min_length_code;
+  }
+
+  template <typename Callback>
+  void ForEach(Callback callback) const {
+    const uint8_t* in = data;
+    uint32_t values[4];
+    uint32_t docid = 0;
+    for (uint32_t i = 0; i + 1 < count; i += 2) {
+      in = DecodeGroup(in, values);
+      docid += values[0];
+      callback(docid, values[1]);
+      docid += values[2];
+      callback(docid, values[3]);
+    }
+    if (count % 2 != 0) {
+      DecodeGroup(in, values);
+      callback(docid + values[0], values[1]);
+    }
+  }
+
+private:
+  static const uint8_t* DecodeGroup(const uint8_t* in, uint32_t (&values)[4]) {
+    const uint8_t control = *in++;
+    for (int i = 0; i < 4; ++i) {
+      const int length = ((control >> (2 * i)) & 3) + 1;
+      uint32_t value = in[0];
+      for (int byte = 1; byte < length; ++byte) {
+        value |= uint32_t(in[byte]) << (8 * byte);
+      }
+      values[i] = value;
+      in += length;
+    }
+    return in;
+  }
+
+  friend class PostingsCursor;
+
+  const uint8_t* data = nullptr;
+  uint32_t count = 0;
+  const PostingsSkip* skips = nullptr;
+  uint32_t max_hitcount = 0;
+  uint32_t min_length_code = 0;
+};
+
+// Обход постингов по возрастанию номеров документов с переходом к первому
+// документу не меньше заданного. Блоки, которые заведомо меньше, пропускаются
+// по таблице переходов без декодирования.
+class PostingsCursor {
+public:
+  static constexpr uint32_t END = numeric_limits<uint32_t>::max();
+
+  PostingsCursor() = default;
+  explicit PostingsCursor(PostingsView postings);
+
+  // END, когда постинги закончились
+  uint32_t Docid() const {
+    return docid;
+  }
+
+  uint32_t Hitcount() const {
+    return hitcounts[position];
+  }
+
+  void Next() {
+    if (++position < block_length) {
+      docid = docids[position];
+    } else {
+      LoadBlock(block + 1);
+    }
+  }
+
+  void NextGEQ(uint32_t target);
+  // Оценка сверху для блока, в котором мог бы лежать документ target,
+  // не декодируя его; для коротких списков — оценка всего списка.
+  // Цели должны не убывать.
+  PostingsSkip BlockBound(uint32_t target);
+
+private:
+  void LoadBlock(size_t new_block);
+
+  friend class PositionsReader;
+
+  PostingsView postings;
+  size_t block = 0;
+  size_t shallow_block = 0;
+  uint32_t block_length = 0;
+  uint32_t position = 0;
+  uint32_t docid = END;
+  uint32_t docids[PostingsView::BLOCK_SIZE];
+  uint32_t hitcounts[PostingsView::BLOCK_SIZE];
+};
+
+// Позиции слова в документах в порядке его постингов: для каждого
+// документа hitcount номеров слов в документе, первый как есть, остальные
+// разностями с предыдущим, в формате varint. У списков длиннее блока
+// поток начинается с таблицы смещений начала каждого блока постингов.
+struct PositionsView {
+  const uint8_t* data = nullptr;
+  uint32_t count = 0;
+};
+
+// Читает позиции слова в документе, на котором стоит курсор постингов
+// того же слова. Документы должны запрашиваться по возрастанию.
+class PositionsReader {
+public:
+  PositionsReader() = default;
+  explicit PositionsReader(PositionsView positions)
+    : positions(positions)
+  {
+  }
+
+  const vector<uint32_t>& Read(const PostingsCursor& cursor);
+
+private:
+  PositionsView positions;
+  size_t block = numeric_limits<size_t>::max();
+  // Номер в блоке следующего за прочитанным постинга и начало его позиций
+  uint32_t next_position = 0;
+  const uint8_t* in = nullptr;
+  vector<uint32_t> values;
+};
+
+// Длина документа в словах, сжатая до байта: до 16 слов точно,
+// дальше с четырьмя значащими битами. Для BM25 такой точности хватает.
+uint8_t EncodeDocumentLength(uint32_t length);
+uint32_t DecodeDocumentLength(uint8_t code);
+
+// Индекс хранится одним непрерывным сегментом, который можно записать
+// в файл и затем отобразить в память без разбора: заголовок, таблица
+// словаря с открытой адресацией, строки слов, смещения и тексты
+// документов (необязательно), сжатые постинги, а с store_positions ещё
+// и позиции слов отдельным разделом в конце, который запросы без фраз
+// не читают. Построенный в памяти индекс имеет тот же формат, поэтому
+// запросы к нему не отличаются.
 class InvertedIndex {
 public:
   struct Entry {
-    size_t docid, hitcount;
+    uint32_t docid, hitcount;
+  };
+
+  InvertedIndex();
+  // Документы читаются блоками по block_size байт, которые индексируются
+  // параллельно не более чем в threads потоков; результат совпадает
+  // с последовательным построением. Без store_documents в индексе
+  // остаются только словарь и постинги. Позиции слов собираются
+  // за тот же проход по документам.
+  explicit InvertedIndex(
+    istream& document_input,
+    size_t block_size = 1 << 22,
+    size_t threads = max(thread::hardware_concurrency(), 1u),
+    bool store_documents = true,
+    bool store_positions = false
+  );
+
+  // Отображает записанный Save сегмент в память только для чтения.
+  // Страницы подгружаются по мере обращения и разделяются между
+  // процессами, открывшими тот же файл.
+  static InvertedIndex Open(const string& path);
+  void Save(const string& path, bool store_documents = true) const;
+
+  // Сливает индексы, документы которых нумеруются подряд в порядке
+  // перечисления. Удалённые документы сохраняют свои номера,
+  // но пропадают из постингов и становятся пустыми. Позиции остаются,
+  // только если они есть во всех источниках.
+  struct MergeSource {
+    const InvertedIndex* index;
+    const vector<bool>* deleted;
+  };
+  static InvertedIndex Merge(const vector<MergeSource>& sources);
+
+  PostingsView Lookup(string_view word) const;
+  // Пусто, если позиции не хранятся или слова нет
+  PositionsView LookupPositions(string_view word) const;
+
+  size_t GetDocumentCount() const {
+    return header.doc_count;
+  }
+
+  bool HasDocuments() const {
+    return header.has_documents != 0;
+  }
+
+  bool HasPositions() const {
+    return header.has_positions != 0;
+  }
+
+  // Текст документа, если документы хранятся в индексе
+  string_view GetDocument(size_t docid) const;
+
+  size_t GetPostingsBytes() const {
+    return header.postings_bytes;
+  }
+
+  // Сжатые длины документов и их точная сумма для BM25
+  const uint8_t* GetLengthCodes() const {
+    return length_codes;
+  }
+
+  uint64_t GetTotalLength() const {
+    return header.total_length;
+  }
+
+private:
+  struct Header {
+    char magic[8] = {};
+    uint64_t term_slots = 0;
+    uint64_t words_bytes = 0;
+    uint64_t doc_count = 0;
+    uint64_t has_documents = 0;
+    uint64_t documents_bytes = 0;
+    uint64_t postings_bytes = 0;
+    uint64_t total_length = 0;
+    uint64_t skips_count = 0;
+    uint64_t has_positions = 0;
+    uint64_t positions_bytes = 0;
   };
 
-  InvertedIndex() = default;
-  explicit InvertedIndex(istream& document_input);
+  // Начала разделов сегмента; каждый раздел выровнен на 8 байт.
+  // Раздел позиций начинается со смещений потоков позиций слов
+  // по слотам словаря.
+  struct Layout {
+    size_t terms, words, doc_offsets, documents, length_codes, postings, skips, positions, end;
+  };
 
-  const vector<Entry>& Lookup(string_view word) const;
+  // Слот словаря в сегменте; слово нулевой длины означает свободный слот
+  // Для списков длиннее блока skips_offset — номер первой записи
+  // таблицы переходов слова.
+  struct SegmentTerm {
+    uint64_t word_offset;
+    uint64_t postings_offset;
+    uint64_t skips_offset;
+    uint32_t word_size;
+    uint32_t postings_count;
+    uint32_t max_hitcount;
+    uint32_t min_length_code;
+  };
+
+  // Слот словаря во время построения; пустое слово означает свободный
+  // слот, а index — номер списка слова в term_postings.
+  struct Term {
+    string_view word;
+    uint32_t index = 0;
+  };
+
+  // Индекс блока документов с номерами документов от нуля,
+  // а также накопленный индекс всех уже слитых блоков. С store_positions
+  // для каждого слова хранятся позиции всех его вхождений подряд
+  // в порядке постингов.
+  struct Shard {
+    bool store_positions = false;
+    vector<string_view> docs;
+    vector<uint8_t> length_codes;
+    uint64_t total_length = 0;
+    vector<Term> terms;
+    vector<vector<Entry>> term_postings;
+    vector<vector<uint32_t>> term_positions;
+  };
 
-  const deque<string>& GetDocuments() const {
-    return docs;
+  static size_t FindSlot(const vector<Term>& terms, string_view word);
+  static void Rehash(vector<Term>& terms, size_t new_capacity);
+  // Номер списка слова в term_postings
+  static uint32_t AddTerm(Shard& shard, string_view word);
+  static Shard BuildShard(string_view text, bool store_positions);
+  static void MergeShard(Shard& merged, Shard shard);
+  static Layout GetLayout(const Header& header);
+  const SegmentTerm* FindTerm(string_view word) const;
+
+  void WriteSegment(Shard& merged, bool store_documents);
+  void Attach(shared_ptr<const void> storage, const uint8_t* data, size_t size);
+
+  // Владеет памятью сегмента: буфером или отображением файла
+  shared_ptr<const void> storage;
+  const uint8_t* segment = nullptr;
+  size_t segment_size = 0;
+
+  Header header;
+  const SegmentTerm* terms = nullptr;
+  const char* words = nullptr;
+  const uint64_t* doc_offsets = nullptr;
+  const char* documents = nullptr;
+  const uint8_t* length_codes = nullptr;
+  const uint8_t* postings = nullptr;
+  const PostingsSkip* skips = nullptr;
+  const uint64_t* positions_offsets = nullptr;
+  const uint8_t* positions = nullptr;
+};
+
+// Неизменяемый набор сегментов, каждый из которых покрывает отрезок
+// номеров документов. Изменения создают новый набор, разделяющий
+// с прежним все нетронутые сегменты и битовые маски удалений.
+class SegmentedIndex {
+public:
+  struct Segment {
+    shared_ptr<const InvertedIndex> index;
+    uint32_t first_docid = 0;
+    // Удалённые документы сегмента; nullptr, если удалений нет
+    shared_ptr<const vector<bool>> deleted;
+
+    bool IsDeleted(uint32_t docid) const {
+      return deleted && (*deleted)[docid - first_docid];
+    }
+  };
+
+  SegmentedIndex() = default;
+  explicit SegmentedIndex(InvertedIndex index);
+
+  const vector<Segment>& GetSegments() const {
+    return segments;
+  }
+
+  size_t GetDocumentCount() const {
+    return segments.empty() ? 0 : segments.back().first_docid + segments.back().index->GetDocumentCount();
+  }
+
+  // Пустая строка для удалённых документов и несуществующих номеров
+  string_view GetDocument(uint32_t docid) const;
+
+  // Номер версии, который SearchServer присваивает при публикации;
+  // по нему кеш запросов отличает ответы, посчитанные по другим версиям.
+  uint64_t GetGeneration() const {
+    return generation;
+  }
+  void SetGeneration(uint64_t value) {
+    generation = value;
   }
 
+  SegmentedIndex Append(InvertedIndex index) const;
+  SegmentedIndex Delete(uint32_t docid) const;
+  // Заменяет сегменты [first, last) слитым из них сегментом, сохраняя
+  // удаления, сделанные после начала слияния.
+  SegmentedIndex ReplaceWithMerged(size_t first, size_t last, InvertedIndex merged) const;
+
+  // Сегменты образуют уровни по размеру: как только в хвосте набирается
+  // MERGE_FACTOR сегментов, хвост вместе с соседями не больше его
+  // сливается в один, так что сегментов остаётся O(log N).
+  static constexpr size_t MERGE_FACTOR = 4;
+  optional<pair<size_t, size_t>> PickMerge() const;
+  InvertedIndex Merge(size_t first, size_t last) const;
+
 private:
-  deque<string> docs;
-  map<string_view, vector<Entry>> index;
+  size_t FindSegment(uint32_t docid) const;
+
+  vector<Segment> segments;
+  uint64_t generation = 0;
+};
+
+// Дописывает docids в формате PostingsView. Если передан skips, для списков
+// длиннее блока дописывает в него таблицу переходов, оценивая блоки
+// по кодам длин документов length_codes.
+void EncodePostings(
+  const vector<InvertedIndex::Entry>& docids, vector<uint8_t>& out,
+  vector<PostingsSkip>* skips = nullptr, const uint8_t* length_codes = nullptr
+);
+
+// Способ ранжирования результатов поиска
+enum class Ranking {
+  // Сумма вхождений слов запроса в документ, как в исходной задаче
+  HitCount,
+  // Okapi BM25 со статистикой по всем сегментам индекса
+  Bm25,
+};
+
+// Этапы обработки запроса, задержки которых собирает SearchServer
+enum class QueryStage {
+  // Разбиение на слова и построение ключа кеша
+  Split,
+  // Поиск в кеше и подсчёт релевантности по постингам
+  Lookup,
+  // Выбор и сортировка пяти лучших документов
+  Sort,
+  // Форматирование ответа
+  Output,
+};
+
+struct Bm25Params {
+  float k1 = 1.2f;
+  float b = 0.75f;
+  // Наибольшая прибавка за близость слов запроса друг к другу; действует,
+  // если в индексе есть позиции
+  float proximity = 1.0f;
+};
+
+struct SearchResult {
+  uint32_t docid;
+  size_t hitcount;
+  // Релевантность по BM25; при ранжировании по hitcount не считается
+  float score = 0;
+};
+
+// Считает релевантность только для документов, встретившихся в постингах
+// слов запроса, и выбирает из них пять лучших, так что стоимость запроса
+// зависит от длины постингов, а не от размера базы.
+//
+// С pruning запросы BM25 с длинными постингами обходятся по документам
+// алгоритмом MaxScore: слова, чьих оценок сверху в сумме не хватает, чтобы
+// войти в пятёрку, проверяются только для документов из остальных списков,
+// а их блоки пропускаются по таблице переходов. Результат совпадает
+// с полным обходом.
+//
+// Фраза считается как отдельное слово, вхождения которого — места, где
+// её слова идут подряд; без позиций в индексе её слова ищутся порознь.
+// Для BM25 по индексу с позициями RERANK_DEPTH лучших документов получают
+// прибавку за близость слов запроса, и из них выбираются пять.
+//
+// Если задан пул потоков и в нём есть свободные, запрос без фраз,
+// постинги которого длиннее PARALLEL_MIN_POSTINGS, считается по
+// диапазонам номеров документов: вызывающий поток и свободные потоки
+// пула по очереди забирают следующий диапазон, пока они не кончатся,
+// а пятёрки диапазонов затем сливаются. С pruning диапазоны обходятся
+// MaxScore и отсекают документы по пятой оценке, общей для всех
+// диапазонов. Запросы BM25 с переранжированием по близости всегда
+// считаются в одном потоке.
+class QueryEvaluator {
+public:
+  explicit QueryEvaluator(Bm25Params bm25 = {}, bool pruning = true)
+    : bm25(bm25)
+    , pruning(pruning)
+  {
+  }
+
+  const vector<SearchResult>& Evaluate(
+    const InvertedIndex& index, const vector<string_view>& words, Ranking ranking = Ranking::HitCount
+  );
+  // Удалённые документы пропускаются
+  const vector<SearchResult>& Evaluate(
+    const SegmentedIndex& index, const vector<string_view>& words, Ranking ranking = Ranking::HitCount
+  );
+  const vector<SearchResult>& Evaluate(
+    const InvertedIndex& index, const Query& query, Ranking ranking = Ranking::HitCount
+  );
+  const vector<SearchResult>& Evaluate(
+    const SegmentedIndex& index, const Query& query, Ranking ranking = Ranking::HitCount
+  );
+
+  static constexpr size_t RERANK_DEPTH = 50;
+  static constexpr size_t PARALLEL_MIN_POSTINGS = 1 << 16;
+  static constexpr size_t MIN_RANGE_DOCS = 1 << 12;
+
+  // nullptr — считать каждый запрос в одном потоке
+  void SetThreadPool(ThreadPool* new_pool) {
+    pool = new_pool;
+  }
+
+private:
+  struct SegmentRef {
+    const InvertedIndex* index;
+    uint32_t first_docid;
+    const vector<bool>* deleted;
+  };
+
+  const vector<SearchResult>& EvaluateSegments(
+    size_t doc_count, const vector<string_view>& words, const vector<vector<string_view>>& phrases, Ranking ranking
+  );
+  template <typename Scorer, typename Postings>
+  void Accumulate(const SegmentRef& segment, const Postings& postings, Scorer scorer, vector<typename Scorer::Score>& scores);
+  // Документы сегмента с фразой и число её вхождений в каждый
+  void MatchPhrase(const InvertedIndex& index, const vector<string_view>& phrase, vector<InvertedIndex::Entry>& matches);
+  const vector<SearchResult>& SelectTopByProximity(vector<float>& scores, const vector<string_view>& terms);
+  template <typename Scorer>
+  struct RangeScoring;
+  template <typename Scorer, typename MakeScorer>
+  const vector<SearchResult>& ScoreInParallel(
+    size_t doc_count, const vector<string_view>& words, size_t helpers, bool prune, MakeScorer make_scorer
+  );
+  // Обходит документы сегмента [begin, end); shared_threshold — общая
+  // для параллельных диапазонов пятая оценка, по которой отсекаются
+  // документы и которую поток поднимает, найдя пять лучших своих
+  template <typename Scorer>
+  void PruneSegment(
+    const SegmentRef& segment, const vector<string_view>& words, const vector<Scorer>& scorers,
+    uint32_t begin = 0, uint32_t end = PostingsCursor::END, atomic<double>* shared_threshold = nullptr
+  );
+  template <typename Score>
+  void Offer(const SearchResult& candidate);
+  template <typename Score>
+  const vector<SearchResult>& SelectTop(vector<Score>& scores);
+  template <typename Score>
+  const vector<SearchResult>& SortTop();
+
+  struct PruningTerm {
+    PostingsCursor cursor;
+    double bound;
+    size_t word;
+  };
+
+  Bm25Params bm25;
+  bool pruning;
+  ThreadPool* pool = nullptr;
+  vector<SegmentRef> segments;
+  vector<PruningTerm> pruning_terms;
+  vector<double> bound_prefix;
+  vector<double> contributions;
+  vector<size_t> docid_count;
+  vector<float> docid_score;
+  // Первые touched_count элементов — документы с ненулевой релевантностью
+  vector<uint32_t> touched;
+  size_t touched_count = 0;
+  vector<SearchResult> top;
+  // Документы, которые SelectTopByProximity переранжирует по близости
+  vector<SearchResult> rerank_candidates;
+  vector<string_view> fallback_words;
+  // Совпадения фраз: по списку на каждую пару фразы и сегмента
+  vector<vector<InvertedIndex::Entry>> phrase_matches;
+  // Курсоры и позиции слов фразы или слов, близость которых оценивается
+  vector<PostingsCursor> term_cursors;
+  vector<PositionsReader> term_readers;
+  // Вхождения слов в документ: позиция и номер слова
+  vector<pair<uint32_t, uint32_t>> term_positions;
 };
 
 class SearchServer {
 public:
-  SearchServer() = default;
-  explicit SearchServer(istream& document_input)
-    : index(InvertedIndex(document_input))
+  // Число запросов, ответы на которые хранит кеш; 0 отключает кеш
+  static constexpr size_t DEFAULT_CACHE_CAPACITY = 1 << 16;
+
+  // С store_positions индекс хранит позиции слов, что нужно для фраз
+  // в кавычках и учёта близости слов при ранжировании по BM25
+  explicit SearchServer(
+    Ranking ranking = Ranking::HitCount, size_t cache_capacity = DEFAULT_CACHE_CAPACITY, bool store_positions = false
+  )
+    : ranking(ranking)
+    , store_positions(store_positions)
+    , cache(cache_capacity)
+  {
+  }
+  explicit SearchServer(
+    istream& document_input,
+    Ranking ranking = Ranking::HitCount,
+    size_t cache_capacity = DEFAULT_CACHE_CAPACITY,
+    bool store_positions = false
+  )
+    : index(SegmentedIndex(BuildIndex(document_input, store_positions)))
+    , ranking(ranking)
+    , store_positions(store_positions)
+    , cache(cache_capacity)
   {
   }
 
+  // Перестраивает индекс в фоне. Изменения, сделанные после вызова,
+  // применяются уже к новой базе: они дожидаются её публикации.
   void UpdateDocumentBase(istream& document_input);
+  // Дописывает документы отдельным сегментом и возвращает номер первого
+  // из них. Мелкие сегменты сливаются в фоне.
+  uint32_t AddDocuments(istream& document_input);
+  void DeleteDocument(uint32_t docid);
+  // Подменяет индекс сегментом из файла или сохраняет текущую версию
+  void LoadIndex(const string& path);
+  void SaveIndex(const string& path) const;
   void AddQueriesStream(istream& query_input, ostream& search_results_output);
+  // Дожидается обработки всех переданных потоков запросов и обновлений.
+  // Исключения фоновых задач пробрасываются отсюда или из следующего
+  // вызова, заметившего, что задача завершилась.
+  void Wait();
+
+  // Число сегментов текущей версии индекса; когда фоновые слияния
+  // закончены, оно меньше SegmentedIndex::MERGE_FACTOR
+  size_t GetSegmentCount() const {
+    return index.Get()->GetSegments().size();
+  }
+
+  // Запросы, отличающиеся лишь порядком слов, получают ответ из общего
+  // кеша, пока индекс не изменится
+  QueryCache::Stats GetCacheStats() const {
+    return cache.GetStats();
+  }
+
+  // Распределение задержек этапа по всем обработанным запросам; пусто,
+  // если сервер собран с LATENCY_HISTOGRAMS=0
+  LatencyHistogram GetStageLatency(QueryStage stage) const {
+    return latencies.GetHistogram(static_cast<size_t>(stage));
+  }
+  // Перцентили всех этапов в виде JSON-объекта
+  void WriteLatencyJson(ostream& out) const {
+    latencies.WriteJson(out);
+  }
 
 private:
-  Synchronized<InvertedIndex> index;
+  static InvertedIndex BuildIndex(
+    istream& document_input, bool store_positions, size_t threads = max(thread::hardware_concurrency(), 1u)
+  );
+  // Вызывается под update_mutex
+  void Publish(SegmentedIndex new_index);
+  void RemoveFinishedTasks();
+  void FinishRebuild();
+  void ScheduleMerge();
+  void MergeSegments();
+  void MergeWhilePossible();
+
+  Snapshot<SegmentedIndex> index;
+  Ranking ranking;
+  bool store_positions;
+  // Упорядочивает изменения набора сегментов между собой
+  mutex update_mutex;
+  uint64_t last_generation = 0;
+  // Номер последней запрошенной перестройки и последней опубликованной:
+  // перестройка, закончившаяся позже более новой, не публикуется
+  uint64_t rebuild_requests = 0;
+  uint64_t published_rebuild = 0;
+  atomic<bool> merge_running = false;
+  QueryCache cache;
+  LatencyRecorder latencies{{"split", "lookup", "sort", "output"}};
+  // Пул объявлен раньше задач, чтобы разрушиться после них
+  ThreadPool pool;
   vector<future<void>> async_tasks;
+  future<void> pending_rebuild;
 };
-
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <memory>
+using namespace std;
+
+// Неизменяемое значение, опубликованное через shared_ptr: читатели без
+// блокировок удерживают текущую версию, писатели атомарно подменяют её.
+template <typename T>
+class Snapshot {
+public:
+  explicit Snapshot(T initial = T())
+    : value(make_shared<const T>(move(initial)))
+  {
+  }
+
+  shared_ptr<const T> Get() const {
+    return atomic_load(&value);
+  }
+
+  void Set(T new_value) {
+    atomic_store(&value, make_shared<const T>(move(new_value)));
+  }
+
+private:
+  shared_ptr<const T> value;
+};
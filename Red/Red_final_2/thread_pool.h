@@ -0,0 +1,86 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+using namespace std;
+
+// Фиксированный набор потоков с общей очередью задач.
+// Деструктор дожидается выполнения всех поставленных задач.
+class ThreadPool {
+public:
+  explicit ThreadPool(size_t threads = max(thread::hardware_concurrency(), 1u)) {
+    for (size_t i = 0; i < threads; ++i) {
+      workers.emplace_back([this] { Work(); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      lock_guard guard(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  size_t Size() const {
+    return workers.size();
+  }
+
+  // Сколько потоков возьмут новую задачу сразу, не дожидаясь уже
+  // поставленных в очередь.
+  size_t IdleCount() const {
+    lock_guard guard(m);
+    return idle > tasks.size() ? idle - tasks.size() : 0;
+  }
+
+  template <typename Func>
+  future<invoke_result_t<Func>> Submit(Func func) {
+    auto task = make_shared<packaged_task<invoke_result_t<Func>()>>(move(func));
+    auto result = task->get_future();
+    {
+      lock_guard guard(m);
+      tasks.push([task] { (*task)(); });
+    }
+    cv.notify_one();
+    return result;
+  }
+
+private:
+  void Work() {
+    for (;;) {
+      function<void()> task;
+      {
+        unique_lock lock(m);
+        ++idle;
+        cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+        --idle;
+        if (tasks.empty()) {
+          return;
+        }
+        task = move(tasks.front());
+        tasks.pop();
+      }
+      task();
+    }
+  }
+
+  mutable mutex m;
+  condition_variable cv;
+  queue<function<void()>> tasks;
+  size_t idle = 0;
+  bool stopping = false;
+  vector<thread> workers;
+};
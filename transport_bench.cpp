@@ -0,0 +1,286 @@
+// Benchmark for the transport subsystem of transport_p.cpp on synthetic cities.
+//
+// Build: g++ -std=c++17 -O2 -pthread transport_bench.cpp -o transport_bench
+// Usage: transport_bench [--stops N] [--buses M] [--min-route-len L] [--max-route-len L]
+//                        [--circular-share P] [--queries Q] [--seed S]
+
+#define TRANSPORT_BENCHMARK
+
+#include "transport_p.cpp"
+
+#include <chrono>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <sys/resource.h>
+
+namespace Benchmark {
+	using Clock = std::chrono::steady_clock;
+
+	struct CityParams {
+		unsigned stops_num = 200;
+		unsigned buses_num = 40;
+		unsigned min_route_len = 5;
+		unsigned max_route_len = 20;
+		double circular_share = 0.5;
+		unsigned queries_num = 20000;
+		uint64_t seed = 42;
+	};
+
+	CityParams ParseParams(int argc, char** argv) {
+		CityParams params;
+		for(int i = 1; i + 1 < argc; i += 2) {
+			const std::string_view key = argv[i];
+			const std::string value = argv[i + 1];
+			if(key == "--stops") {
+				params.stops_num = std::stoul(value);
+			} else if(key == "--buses") {
+				params.buses_num = std::stoul(value);
+			} else if(key == "--min-route-len") {
+				params.min_route_len = std::stoul(value);
+			} else if(key == "--max-route-len") {
+				params.max_route_len = std::stoul(value);
+			} else if(key == "--circular-share") {
+				params.circular_share = std::stod(value);
+			} else if(key == "--queries") {
+				params.queries_num = std::stoul(value);
+			} else if(key == "--seed") {
+				params.seed = std::stoull(value);
+			} else {
+				throw std::invalid_argument("Unknown option: " + std::string(key));
+			}
+		}
+		params.stops_num = std::max(params.stops_num, 2u);
+		params.buses_num = std::max(params.buses_num, 1u);
+		params.min_route_len = std::max(params.min_route_len, 3u);
+		params.max_route_len = std::max(params.max_route_len, params.min_route_len);
+		return params;
+	}
+
+	struct City {
+		nlohmann::json json;
+		std::string text;
+	};
+
+	// Same network in both protocols; every pair of consecutive stops of a route gets a road distance
+	City GenerateCity(const CityParams& params) {
+		std::mt19937_64 rng(params.seed);
+		std::uniform_real_distribution<double> latitude(55.55, 55.90), longitude(37.35, 37.85), stretch(1.0, 1.5);
+		std::uniform_int_distribution<unsigned> stop_id(0, params.stops_num - 1);
+		std::uniform_int_distribution<unsigned> route_len(params.min_route_len, params.max_route_len);
+		std::bernoulli_distribution circular(params.circular_share);
+
+		std::vector<std::string> stop_names;
+		std::vector<std::pair<double, double>> stop_coords;
+		std::vector<std::map<std::string, unsigned>> road_distances(params.stops_num);
+		stop_names.reserve(params.stops_num);
+		stop_coords.reserve(params.stops_num);
+		for(unsigned i = 0; i != params.stops_num; ++i) {
+			stop_names.push_back("Stop " + std::to_string(i));
+			stop_coords.emplace_back(latitude(rng), longitude(rng));
+		}
+
+		auto base_requests = nlohmann::json::array();
+		std::ostringstream bus_lines;
+		for(unsigned bus = 0; bus != params.buses_num; ++bus) {
+			const bool is_roundtrip = circular(rng);
+			const unsigned len = route_len(rng);
+			std::vector<unsigned> stops{stop_id(rng)};
+			while(stops.size() != (is_roundtrip ? len - 1 : len)) {
+				if(const auto next = stop_id(rng); next != stops.back()) {
+					stops.push_back(next);
+				}
+			}
+			if(is_roundtrip) {
+				if(stops.back() == stops.front()) {
+					stops.back() = (stops.front() + 1) % params.stops_num;
+				}
+				stops.push_back(stops.front());
+			}
+
+			auto stop_list = nlohmann::json::array();
+			const std::string bus_name = "Bus" + std::to_string(bus);
+			bus_lines << "Bus " << bus_name << ':';
+			for(size_t i = 0; i != stops.size(); ++i) {
+				stop_list.push_back(stop_names[stops[i]]);
+				bus_lines << (i ? (is_roundtrip ? " > " : " - ") : " ") << stop_names[stops[i]];
+				if(i == 0) {
+					continue;
+				}
+				const auto from = stops[i - 1], to = stops[i];
+				if(!road_distances[from].count(stop_names[to]) && !road_distances[to].count(stop_names[from])) {
+					const auto geo_dist = Coordinates(stop_coords[from].first, stop_coords[from].second)
+							.CalcDist({stop_coords[to].first, stop_coords[to].second});
+					road_distances[from][stop_names[to]] = static_cast<unsigned>(geo_dist * stretch(rng)) + 1;
+				}
+			}
+			bus_lines << '\n';
+			base_requests.push_back({
+					{"type",         "Bus"},
+					{"name",         bus_name},
+					{"stops",        std::move(stop_list)},
+					{"is_roundtrip", is_roundtrip}
+			});
+		}
+
+		std::ostringstream text;
+		text.precision(9);
+		text << params.stops_num + params.buses_num << '\n';
+		for(unsigned i = 0; i != params.stops_num; ++i) {
+			base_requests.push_back({
+					{"type",           "Stop"},
+					{"name",           stop_names[i]},
+					{"latitude",       stop_coords[i].first},
+					{"longitude",      stop_coords[i].second},
+					{"road_distances", road_distances[i]}
+			});
+			text << "Stop " << stop_names[i] << ": " << stop_coords[i].first << ", " << stop_coords[i].second;
+			for(auto &[to, dist]: road_distances[i]) {
+				text << ", " << dist << "m to " << to;
+			}
+			text << '\n';
+		}
+		text << bus_lines.str();
+
+		// 40% Bus, 20% Stop, 20% Route, 20% NearestStops; about one in twenty Bus/Stop names is unknown
+		auto stat_requests = nlohmann::json::array();
+		std::uniform_int_distribution<unsigned> bus_id(0, params.buses_num * 21 / 20), kind(0, 9);
+		std::uniform_int_distribution<unsigned> any_stop_id(0, params.stops_num * 21 / 20);
+		std::ostringstream text_queries;
+		unsigned text_queries_num = 0;
+		for(unsigned i = 0; i != params.queries_num; ++i) {
+			const auto k = kind(rng);
+			if(k < 4) {
+				const auto name = "Bus" + std::to_string(bus_id(rng));
+				stat_requests.push_back({{"type", "Bus"}, {"name", name}, {"id", i}});
+				text_queries << "Bus " << name << '\n';
+				++text_queries_num;
+			} else if(k < 6) {
+				const auto name = "Stop " + std::to_string(any_stop_id(rng));
+				stat_requests.push_back({{"type", "Stop"}, {"name", name}, {"id", i}});
+				text_queries << "Stop " << name << '\n';
+				++text_queries_num;
+			} else if(k < 8) {
+				stat_requests.push_back({
+						{"type", "Route"},
+						{"from", stop_names[stop_id(rng)]},
+						{"to",   stop_names[stop_id(rng)]},
+						{"id",   i}
+				});
+			} else {
+				stat_requests.push_back({
+						{"type",      "NearestStops"},
+						{"latitude",  latitude(rng)},
+						{"longitude", longitude(rng)},
+						{"count",     5},
+						{"id",        i}
+				});
+			}
+		}
+
+		// The text protocol has no Route requests
+		text << text_queries_num << '\n' << text_queries.str();
+
+		return {
+				{
+						{"routing_settings", {{"bus_wait_time", 6}, {"bus_velocity", 40}}},
+						{"base_requests",    std::move(base_requests)},
+						{"stat_requests",    std::move(stat_requests)}
+				},
+				text.str()
+		};
+	}
+
+	template<typename Func>
+	double MeasureMs(Func func) {
+		const auto start = Clock::now();
+		func();
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	void ReportStage(const std::string& stage, const double ms) {
+		std::cout << std::left << std::setw(32) << stage << std::right << std::setw(12) << std::fixed
+				  << std::setprecision(3) << ms << " ms\n";
+	}
+
+	void ReportQueries(const std::string& type, std::vector<double>& latencies_us) {
+		if(latencies_us.empty()) {
+			return;
+		}
+		std::sort(latencies_us.begin(), latencies_us.end());
+		const auto percentile = [&latencies_us](const double p) {
+			return latencies_us[std::min<size_t>(latencies_us.size() - 1, latencies_us.size() * p)];
+		};
+		const auto total_us = std::accumulate(latencies_us.begin(), latencies_us.end(), 0.0);
+		std::cout << std::left << std::setw(14) << type << std::right << std::fixed << std::setprecision(2)
+				  << std::setw(10) << latencies_us.size()
+				  << std::setw(14) << latencies_us.size() / total_us * 1e6
+				  << std::setw(10) << percentile(0.5)
+				  << std::setw(10) << percentile(0.9)
+				  << std::setw(10) << percentile(0.99)
+				  << std::setw(10) << latencies_us.back() << '\n';
+	}
+
+	long PeakRssKb() {
+		rusage usage{};
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss;
+	}
+
+	void Run(const CityParams& params) {
+		std::cout << "City: " << params.stops_num << " stops, " << params.buses_num << " buses, route length "
+				  << params.min_route_len << ".." << params.max_route_len << ", circular share "
+				  << params.circular_share << ", " << params.queries_num << " queries, seed " << params.seed << "\n\n";
+
+		const auto city = GenerateCity(params);
+		const auto json_text = city.json.dump();
+
+		std::istringstream unused_input;
+		std::ostringstream sink;
+
+		const unsigned threads_num = std::max(std::thread::hardware_concurrency(), 1u);
+		for(const unsigned chunks_num : std::set<unsigned>{1, threads_num}) {
+			ReportStage("text ingest, " + std::to_string(chunks_num) + " chunk(s)", MeasureMs([&] {
+				std::string_view text = city.text;
+				DataBase(unused_input, sink).FillDB(text, chunks_num);
+			}));
+		}
+		ReportStage("text ingest + Bus/Stop queries", MeasureMs([&] {
+			DataBase(unused_input, sink).ProcessAll(city.text);
+		}));
+
+		nlohmann::json requests;
+		ReportStage("JSON parse", MeasureMs([&] { requests = nlohmann::json::parse(json_text); }));
+
+		DataBase db(unused_input, sink);
+		ReportStage("JSON ingest", MeasureMs([&] { db.ProcessBaseRequests(requests); }));
+		ReportStage("route distances", MeasureMs([&] { db.InitDists(); }));
+		ReportStage("stop index", MeasureMs([&] { db.BuildStopIndex(); }));
+		ReportStage("graph and router", MeasureMs([&] { db.BuildGraph(); }));
+
+		std::map<std::string, std::vector<double>> latencies_us;
+		const auto queries_ms = MeasureMs([&] {
+			for(auto& request: requests["stat_requests"]) {
+				const auto start = Clock::now();
+				db.WriteStatQuery(request, sink);
+				latencies_us[request["type"]].push_back(
+						std::chrono::duration<double, std::micro>(Clock::now() - start).count()
+				);
+			}
+		});
+		ReportStage("stat queries", queries_ms);
+
+		std::cout << '\n' << std::left << std::setw(14) << "query" << std::right << std::setw(10) << "count"
+				  << std::setw(14) << "queries/s" << std::setw(10) << "p50, us" << std::setw(10) << "p90, us"
+				  << std::setw(10) << "p99, us" << std::setw(10) << "max, us" << '\n';
+		for(auto &[type, type_latencies_us]: latencies_us) {
+			ReportQueries(type, type_latencies_us);
+		}
+		std::cout << "\nPeak RSS: " << PeakRssKb() << " KB" << std::endl;
+	}
+}
+
+int main(int argc, char** argv) {
+	Benchmark::Run(Benchmark::ParseParams(argc, argv));
+	return 0;
+}
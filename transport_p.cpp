@@ -5,6 +5,19 @@
 #include <cmath>
 #include <vector>
 #include <unordered_set>
+#include <algorithm>
+#include <array>
+#include <future>
+#include <random>
+#include <charconv>
+#include <cstring>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "json.h"
 
 #include "graph.h"
@@ -17,7 +30,8 @@ namespace Request {
 	enum class Name {
 		STOP,
 		BUS,
-		ROUTE
+		ROUTE,
+		NEAREST_STOPS
 	};
 
 	std::ostream& operator<<(std::ostream& stream, const Name& type) {
@@ -28,8 +42,11 @@ namespace Request {
 			case Request::Name::BUS:
 				stream << "Request::Name::BUS";
 				break;
-			default:
+			case Request::Name::ROUTE:
 				stream << "Request::Name::ROUTE";
+				break;
+			default:
+				stream << "Request::Name::NEAREST_STOPS";
 		}
 		return stream;
 	}
@@ -70,12 +87,13 @@ std::ostream& operator<<(std::ostream& stream, const RouteType& type) {
 static const std::unordered_map<std::string, Request::Name> requestNames = {
 		{"Stop",  Request::Name::STOP},
 		{"Bus",   Request::Name::BUS},
-		{"Route", Request::Name::ROUTE}
+		{"Route", Request::Name::ROUTE},
+		{"NearestStops", Request::Name::NEAREST_STOPS}
 };
 
 Request::Name ParseRequestName(std::istream& stream) {
 	Request::Name requestName;
-	static std::string request;
+	static thread_local std::string request;
 	stream >> std::ws >> request;
 	requestName = requestNames.at(request);
 	request.clear();
@@ -92,10 +110,16 @@ public:
 	Coordinates(double latitude, double longitude) : latitude(latitude * factor), longitude(longitude * factor) {}
 
 	[[nodiscard]] double CalcDist(const Coordinates& other) const noexcept {
-		return acos(
+		return acos(std::min(
 				sin(latitude) * sin(other.latitude) +
-				cos(latitude) * cos(other.latitude) * cos(std::abs(longitude - other.longitude))
-		) * 6371000;
+				cos(latitude) * cos(other.latitude) * cos(std::abs(longitude - other.longitude)),
+				1.0
+		)) * 6371000;
+	}
+
+	// Point on the unit sphere
+	[[nodiscard]] std::array<double, 3> ToCartesian() const noexcept {
+		return {cos(latitude) * cos(longitude), cos(latitude) * sin(longitude), sin(latitude)};
 	}
 
 	bool operator==(const Coordinates& other) const noexcept {
@@ -130,7 +154,8 @@ struct StopInfo {
 
 	StopInfo(std::string name, const Coordinates coordinates) : name(std::move(name)), coordinates(coordinates) {}
 
-	StopInfo(StopInfo&& other) noexcept : name(std::move(other.name)), coordinates(other.coordinates) {}
+	StopInfo(StopInfo&& other) noexcept : name(std::move(other.name)), coordinates(other.coordinates),
+										  distances(std::move(other.distances)) {}
 
 	bool operator==(const StopInfo& other) const noexcept {
 		return name == other.name && coordinates == other.coordinates;
@@ -245,6 +270,354 @@ RouteInfo ParseNewRoute(std::istream& stream) {
 	return route_info;
 }
 
+namespace TextProtocol {
+	class MappedFile {
+	public:
+		explicit MappedFile(const char* path) {
+			const int fd = open(path, O_RDONLY);
+			if(fd == -1) {
+				throw std::system_error(errno, std::generic_category(), path);
+			}
+			struct stat file_stat{};
+			if(fstat(fd, &file_stat) == -1) {
+				const int error = errno;
+				close(fd);
+				throw std::system_error(error, std::generic_category(), path);
+			}
+			size = file_stat.st_size;
+			if(size != 0) {
+				data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if(data == MAP_FAILED) {
+					const int error = errno;
+					close(fd);
+					throw std::system_error(error, std::generic_category(), path);
+				}
+				madvise(data, size, MADV_SEQUENTIAL);
+			}
+			close(fd);
+		}
+
+		MappedFile(const MappedFile&) = delete;
+
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile() {
+			if(data) {
+				munmap(data, size);
+			}
+		}
+
+		[[nodiscard]] std::string_view View() const noexcept {
+			return {static_cast<const char*>(data), size};
+		}
+
+	private:
+		void* data = nullptr;
+		size_t size = 0;
+	};
+
+	std::string_view LeftStrip(std::string_view sv) {
+		while(!sv.empty() && (sv.front() == ' ' || sv.front() == '\t')) {
+			sv.remove_prefix(1);
+		}
+		return sv;
+	}
+
+	std::string_view RightStrip(std::string_view sv) {
+		while(!sv.empty() && (sv.back() == ' ' || sv.back() == '\t' || sv.back() == '\r')) {
+			sv.remove_suffix(1);
+		}
+		return sv;
+	}
+
+	std::string_view ReadUntil(std::string_view& sv, const char delim) {
+		const auto pos = sv.find(delim);
+		const auto result = sv.substr(0, pos);
+		sv.remove_prefix(pos == std::string_view::npos ? sv.size() : pos + 1);
+		return result;
+	}
+
+	std::string_view ReadLine(std::string_view& text) {
+		return RightStrip(ReadUntil(text, '\n'));
+	}
+
+	template<typename Number>
+	Number ReadNumber(std::string_view& sv) {
+		sv = LeftStrip(sv);
+		Number result{};
+		const auto[end, error] = std::from_chars(sv.data(), sv.data() + sv.size(), result);
+		if(error != std::errc()) {
+			throw std::invalid_argument("Bad number: " + std::string(sv));
+		}
+		sv.remove_prefix(end - sv.data());
+		return result;
+	}
+
+	// Cuts the first lines_num lines off the text
+	std::string_view ReadLines(std::string_view& text, unsigned lines_num) {
+		size_t pos = 0;
+		for(; lines_num != 0 && pos < text.size(); --lines_num) {
+			const auto eol = static_cast<const char*>(std::memchr(text.data() + pos, '\n', text.size() - pos));
+			pos = eol ? eol - text.data() + 1 : text.size();
+		}
+		const auto result = text.substr(0, pos);
+		text.remove_prefix(pos);
+		return result;
+	}
+
+	// Splits the text into at most chunks_num pieces of similar size, cutting only at line boundaries
+	std::vector<std::string_view> SplitIntoChunks(std::string_view text, const unsigned chunks_num) {
+		std::vector<std::string_view> result;
+		result.reserve(chunks_num);
+		const size_t chunk_size = text.size() / std::max(chunks_num, 1u) + 1;
+		while(!text.empty()) {
+			auto pos = text.find('\n', std::min(chunk_size, text.size()) - 1);
+			pos = (pos == std::string_view::npos) ? text.size() : pos + 1;
+			result.push_back(text.substr(0, pos));
+			text.remove_prefix(pos);
+		}
+		return result;
+	}
+}
+
+// Writes JSON values straight into a stream; the output matches nlohmann::json::dump()
+namespace JsonOutput {
+	void WriteRaw(std::ostream& out, std::string_view text) {
+		out.write(text.data(), text.size());
+	}
+
+	void WriteString(std::ostream& out, std::string_view str) {
+		out.put('"');
+		while(!str.empty()) {
+			const auto plain = std::find_if(str.begin(), str.end(), [](const char c) {
+				return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+			});
+			out.write(str.data(), plain - str.begin());
+			str.remove_prefix(plain - str.begin());
+			if(str.empty()) {
+				break;
+			}
+			switch(const char c = str.front()) {
+				case '"':
+					out.write("\\\"", 2);
+					break;
+				case '\\':
+					out.write("\\\\", 2);
+					break;
+				case '\b':
+					out.write("\\b", 2);
+					break;
+				case '\f':
+					out.write("\\f", 2);
+					break;
+				case '\n':
+					out.write("\\n", 2);
+					break;
+				case '\r':
+					out.write("\\r", 2);
+					break;
+				case '\t':
+					out.write("\\t", 2);
+					break;
+				default: {
+					static constexpr char hex[] = "0123456789abcdef";
+					const char escaped[] = {'\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF]};
+					out.write(escaped, sizeof(escaped));
+				}
+			}
+			str.remove_prefix(1);
+		}
+		out.put('"');
+	}
+
+	template<typename Integer>
+	void WriteNumber(std::ostream& out, const Integer value) {
+		char buffer[24];
+		out.write(buffer, std::to_chars(buffer, buffer + sizeof(buffer), value).ptr - buffer);
+	}
+
+	// Shortest representation that reads back the same; integral values keep ".0" like nlohmann does
+	void WriteNumber(std::ostream& out, const double value) {
+		if(!std::isfinite(value)) {
+			out.write("null", 4);
+			return;
+		}
+		char buffer[32];
+		const auto end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+		out.write(buffer, end - buffer);
+		if(std::find_if(buffer, end, [](const char c) { return c == '.' || c == 'e'; }) == end) {
+			out.write(".0", 2);
+		}
+	}
+}
+
+Request::Name ParseRequestName(std::string_view& line) {
+	line = TextProtocol::LeftStrip(line);
+	const auto name = TextProtocol::ReadUntil(line, ' ');
+	return requestNames.at(std::string(name));
+}
+
+std::string_view ParseRouteName(std::string_view& line, const Request::RouteRequestType type) {
+	line = TextProtocol::LeftStrip(line);
+	return TextProtocol::RightStrip(
+			(type == Request::RouteRequestType::NEW) ? TextProtocol::ReadUntil(line, ':') : std::exchange(line, {})
+	);
+}
+
+StopInfo ParseNewStop(std::string_view line) {
+	using namespace TextProtocol;
+	line = LeftStrip(line);
+	StopInfo bus_stop_info;
+	bus_stop_info.name = ReadUntil(line, ':');
+	const auto latitude = ReadNumber<double>(line);
+	ReadUntil(line, ',');
+	bus_stop_info.coordinates = {latitude, ReadNumber<double>(line)};
+
+	ReadUntil(line, ',');
+	while(!LeftStrip(line).empty()) {
+		const auto dist = ReadNumber<unsigned>(line);
+		line.remove_prefix(std::min<size_t>(5, line.size()));
+		bus_stop_info.distances.emplace(RightStrip(ReadUntil(line, ',')), dist);
+	}
+	return bus_stop_info;
+}
+
+RouteInfo ParseNewRoute(std::string_view line) {
+	RouteInfo route_info;
+	const auto delim_pos = line.find_first_of(">-");
+	if(delim_pos == std::string_view::npos) {
+		throw std::invalid_argument("Bad route: " + std::string(line));
+	}
+	const char delim = line[delim_pos];
+	route_info.type = (delim == '>') ? RouteType::CIRCULAR : RouteType::LOOPING;
+	route_info.stops.reserve(std::count(line.begin(), line.end(), delim) + 1);
+	while(!line.empty()) {
+		route_info.stops.emplace_back(
+				TextProtocol::RightStrip(TextProtocol::LeftStrip(TextProtocol::ReadUntil(line, delim)))
+		);
+	}
+	return route_info;
+}
+
+// Static k-d tree over stops packed into one array: the root of every subtree is the middle of its range.
+// Stops are placed on the unit sphere, so the nearest by chord are the nearest by great-circle distance.
+class StopIndex {
+public:
+	struct Neighbour {
+		double chord2;
+		unsigned point_idx;
+
+		bool operator<(const Neighbour& other) const noexcept {
+			return chord2 < other.chord2;
+		}
+	};
+
+	StopIndex() = default;
+
+	explicit StopIndex(const std::vector<std::pair<std::string_view, Coordinates>>& stops) {
+		points.reserve(stops.size());
+		for(auto &[name, coordinates]: stops) {
+			points.push_back({coordinates.ToCartesian(), 0, name, coordinates});
+		}
+		Build(0, points.size());
+	}
+
+	// Fills nearest with up to count stops ordered by distance. Doesn't allocate if nearest has enough capacity.
+	void FindNearest(const Coordinates& target, const size_t count, std::vector<Neighbour>& nearest) const {
+		nearest.clear();
+		if(count != 0) {
+			Search(0, points.size(), target.ToCartesian(), count, nearest);
+		}
+		std::sort_heap(nearest.begin(), nearest.end());
+	}
+
+	[[nodiscard]] std::string_view Name(const Neighbour& neighbour) const noexcept {
+		return points[neighbour.point_idx].name;
+	}
+
+	[[nodiscard]] const Coordinates& GetCoordinates(const Neighbour& neighbour) const noexcept {
+		return points[neighbour.point_idx].coordinates;
+	}
+
+	[[nodiscard]] size_t Size() const noexcept {
+		return points.size();
+	}
+
+private:
+	struct Point {
+		std::array<double, 3> xyz;
+		unsigned axis;
+		std::string_view name;
+		Coordinates coordinates;
+	};
+
+	std::vector<Point> points;
+
+	void Build(const size_t begin, const size_t end) {
+		if(end - begin < 2) {
+			return;
+		}
+		std::array<double, 3> min_xyz = points[begin].xyz, max_xyz = points[begin].xyz;
+		for(size_t i = begin + 1; i != end; ++i) {
+			for(unsigned axis = 0; axis != 3; ++axis) {
+				min_xyz[axis] = std::min(min_xyz[axis], points[i].xyz[axis]);
+				max_xyz[axis] = std::max(max_xyz[axis], points[i].xyz[axis]);
+			}
+		}
+		unsigned axis = 0;
+		for(unsigned other = 1; other != 3; ++other) {
+			if(max_xyz[other] - min_xyz[other] > max_xyz[axis] - min_xyz[axis]) {
+				axis = other;
+			}
+		}
+
+		const auto mid = begin + (end - begin) / 2;
+		std::nth_element(
+				points.begin() + begin, points.begin() + mid, points.begin() + end,
+				[axis](const Point& lhs, const Point& rhs) {
+					return lhs.xyz[axis] < rhs.xyz[axis];
+				}
+		);
+		points[mid].axis = axis;
+		Build(begin, mid);
+		Build(mid + 1, end);
+	}
+
+	void Search(const size_t begin, const size_t end, const std::array<double, 3>& target, const size_t count,
+				std::vector<Neighbour>& heap) const {
+		if(begin == end) {
+			return;
+		}
+		const auto mid = begin + (end - begin) / 2;
+		const auto& point = points[mid];
+		double chord2 = 0;
+		for(unsigned axis = 0; axis != 3; ++axis) {
+			chord2 += (point.xyz[axis] - target[axis]) * (point.xyz[axis] - target[axis]);
+		}
+		if(heap.size() < count) {
+			heap.push_back({chord2, static_cast<unsigned>(mid)});
+			std::push_heap(heap.begin(), heap.end());
+		} else if(chord2 < heap.front().chord2) {
+			std::pop_heap(heap.begin(), heap.end());
+			heap.back() = {chord2, static_cast<unsigned>(mid)};
+			std::push_heap(heap.begin(), heap.end());
+		}
+
+		const auto diff = target[point.axis] - point.xyz[point.axis];
+		if(diff < 0) {
+			Search(begin, mid, target, count, heap);
+			if(heap.size() < count || diff * diff < heap.front().chord2) {
+				Search(mid + 1, end, target, count, heap);
+			}
+		} else {
+			Search(mid + 1, end, target, count, heap);
+			if(heap.size() < count || diff * diff < heap.front().chord2) {
+				Search(begin, mid, target, count, heap);
+			}
+		}
+	}
+};
+
 class DataBase {
 	struct StopData;
 	using StopStats = std::unordered_map<std::string, StopData>;
@@ -274,7 +647,6 @@ class DataBase {
 					dists->reserve(num_stops - 1);
 					CalcCircularDist(stop_coords);
 			}
-			inStopsNum += num_stops;
 		}
 
 	private:
@@ -373,13 +745,31 @@ class DataBase {
 		using WeightType = double;
 		using Router = Graph::Router<WeightType>;
 	public:
-		GraphBuilder(const RouteStats& routeStats, const StopStats& stopStats, const TemporalInfo& temporalInfo) :
+		GraphBuilder(const RouteStats& routeStats, const StopStats& stopStats, const TemporalInfo& temporalInfo,
+					 const unsigned inStopsNum) :
 				graph(inStopsNum + stopStats.size()),
 				outStopIDtoName(InitOutStopIDtoStopName(stopStats)),
-				nameToOutStopID(InitNameToOutStopID(outStopIDtoName)),
+				nameToOutStopID(InitNameToOutStopID(outStopIDtoName, inStopsNum)),
 				maxEdgeIDtoRouteName(InitGraphAndMaxEdgeIDtoRouteName(routeStats, temporalInfo)),
 				router(graph) {}
 
+		[[nodiscard]] bool IsOutStop(const Graph::VertexId vertexID) const noexcept {
+			return vertexID >= MinOutStopID();
+		}
+
+		[[nodiscard]] std::string_view OutStopName(const Graph::VertexId outStopID) const noexcept {
+			return outStopIDtoName[outStopID - MinOutStopID()];
+		}
+
+		[[nodiscard]] std::string_view RouteName(const Graph::EdgeId edgeID) const noexcept {
+			return std::lower_bound(
+					maxEdgeIDtoRouteName.begin(), maxEdgeIDtoRouteName.end(), edgeID,
+					[](const auto& maxEdgeIDAndName, const Graph::EdgeId id) {
+						return maxEdgeIDAndName.first < id;
+					}
+			)->second;
+		}
+
 		template<typename It>
 		struct ItRange {
 			It begin, end;
@@ -388,13 +778,20 @@ class DataBase {
 		Graph::DirectedWeightedGraph<double> graph;
 		const std::vector<std::string_view> outStopIDtoName;
 		const std::unordered_map<std::string_view, unsigned> nameToOutStopID;
-		const std::map<unsigned, std::string_view> maxEdgeIDtoRouteName;
-		const Router router;
+		// Edges of every route are contiguous, so the route of an edge is the one with the least max edge ID
+		// not less than it. Sorted by construction.
+		const std::vector<std::pair<Graph::EdgeId, std::string_view>> maxEdgeIDtoRouteName;
+		Router router;
 
 	private:
-		std::map<unsigned, std::string_view>
+		[[nodiscard]] Graph::VertexId MinOutStopID() const noexcept {
+			return graph.GetVertexCount() - outStopIDtoName.size();
+		}
+
+		std::vector<std::pair<Graph::EdgeId, std::string_view>>
 		InitGraphAndMaxEdgeIDtoRouteName(const RouteStats& routeStats, const TemporalInfo temporalInfo) {
-			std::map<unsigned, std::string_view> result;
+			std::vector<std::pair<Graph::EdgeId, std::string_view>> result;
+			result.reserve(routeStats.size());
 			unsigned inStopID = 0;
 			for(auto &[routeName, routeData]: routeStats) {
 				auto stops_it = routeData.stops.begin();
@@ -423,7 +820,7 @@ class DataBase {
 				}
 				graph.AddEdge({prevInStopID, inStopID, routeData.dists->back() / temporalInfo.velocity});
 				routeData.dists.reset();
-				result.emplace(
+				result.emplace_back(
 						graph.AddEdge({inStopID++, initialOutStopID, 0}),
 						routeName
 				);
@@ -488,7 +885,7 @@ class DataBase {
 		}
 
 		static std::unordered_map<std::string_view, unsigned>
-		InitNameToOutStopID(const std::vector<std::string_view>& outStopIDtoName) {
+		InitNameToOutStopID(const std::vector<std::string_view>& outStopIDtoName, const unsigned inStopsNum) {
 			std::unordered_map<std::string_view, unsigned> result;
 			const unsigned outStopsNum = outStopIDtoName.size();
 			result.reserve(outStopsNum);
@@ -505,10 +902,10 @@ class DataBase {
 	StopStats stop_stats;
 
 	std::optional<GraphBuilder> graph = std::nullopt;
+	StopIndex stop_index;
 	TemporalInfo settings;
+	unsigned inStopsNum = 0;
 public:
-	static unsigned inStopsNum;
-
 	DataBase(std::istream& input, std::ostream& output) : input(input), output(output) {
 		output.precision(6);
 	}
@@ -529,13 +926,19 @@ public:
 					break;
 			}
 		}
-		for(auto& route: route_stats) {
-			route.second.InitDists(stop_stats);
-		}
+		InitDists();
 		return *this;
 	}
 
 	DataBase& FillDB(const nlohmann::json& requests) {
+		ProcessBaseRequests(requests);
+		InitDists();
+		BuildStopIndex();
+		BuildGraph();
+		return *this;
+	}
+
+	DataBase& ProcessBaseRequests(const nlohmann::json& requests) {
 		ProcessSettings(requests["routing_settings"]);
 		for(auto& request: requests["base_requests"]) {
 			switch(requestNames.at(request["type"])) {
@@ -546,10 +949,30 @@ public:
 					ProcessNewBusStop(request);
 			}
 		}
+		return *this;
+	}
+
+	DataBase& InitDists() {
+		inStopsNum = 0;
 		for(auto& route: route_stats) {
 			route.second.InitDists(stop_stats);
+			inStopsNum += route.second.num_stops;
+		}
+		return *this;
+	}
+
+	DataBase& BuildStopIndex() {
+		std::vector<std::pair<std::string_view, Coordinates>> stops;
+		stops.reserve(stop_stats.size());
+		for(auto &[name, stop_data]: stop_stats) {
+			stops.emplace_back(name, stop_data.coordinates);
 		}
-		graph.emplace(GraphBuilder(route_stats, stop_stats, settings));
+		stop_index = StopIndex(stops);
+		return *this;
+	}
+
+	DataBase& BuildGraph() {
+		graph.emplace(route_stats, stop_stats, settings, inStopsNum);
 		return *this;
 	}
 
@@ -575,41 +998,282 @@ public:
 	nlohmann::json ProcessStatQueries(const nlohmann::json& requests) {
 		auto response = nlohmann::json::array();
 		for(auto& request: requests) {
-			switch(requestNames.at(request["type"])) {
-				case Request::Name::BUS:
-					response.emplace_back(ProcessExistingRoute(request));
-					break;
-				case Request::Name::STOP:
-					response.emplace_back(ProcessExistingStop(request));
-					break;
-				default:
-					response.emplace_back(BuildRoute(request));
-			}
+			response.emplace_back(ProcessStatQuery(request));
 		}
 		return response;
 	}
 
+	nlohmann::json ProcessStatQuery(const nlohmann::json& request) {
+		switch(requestNames.at(request["type"])) {
+			case Request::Name::BUS:
+				return ProcessExistingRoute(request);
+			case Request::Name::STOP:
+				return ProcessExistingStop(request);
+			case Request::Name::NEAREST_STOPS:
+				return FindNearestStops(request);
+			default:
+				return BuildRoute(request);
+		}
+	}
+
 	DataBase& ProcessAll() {
 		FillDB();
 		return ProcessStatQueries();
 	}
 
+	DataBase& FillDB(std::string_view& text, const unsigned chunks_num = 1) {
+		const auto n = TextProtocol::ReadNumber<unsigned>(text);
+		TextProtocol::ReadLine(text);
+		std::vector<std::future<ParsedChunk>> parsed_chunks;
+		for(auto chunk: TextProtocol::SplitIntoChunks(TextProtocol::ReadLines(text, n), chunks_num)) {
+			parsed_chunks.push_back(std::async(std::launch::async, ParseChunk, chunk));
+		}
+		for(auto& parsed_chunk: parsed_chunks) {
+			auto chunk = parsed_chunk.get();
+			for(auto& stop_info: chunk.stops) {
+				ProcessNewBusStop(std::move(stop_info));
+			}
+			for(auto &[route_name, route_info]: chunk.routes) {
+				route_stats.emplace(std::move(route_name), RouteData{std::move(route_info)});
+			}
+		}
+		InitDists();
+		return *this;
+	}
+
+	DataBase& ProcessStatQueries(std::string_view& text) {
+		const auto n = TextProtocol::ReadNumber<unsigned>(text);
+		TextProtocol::ReadLine(text);
+		for(unsigned i = 0; i != n; ++i) {
+			auto line = TextProtocol::ReadLine(text);
+			switch(ParseRequestName(line)) {
+				case Request::Name::BUS:
+					ProcessExistingRoute(std::string(ParseRouteName(line, Request::RouteRequestType::EXISTING)));
+					break;
+				default:
+					ProcessExistingStop(std::string(line));
+			}
+		}
+		return *this;
+	}
+
+	// Text protocol over an in-memory buffer; the base requests are parsed in chunks_num parallel chunks
+	DataBase& ProcessAll(std::string_view text, const unsigned chunks_num = 1) {
+		FillDB(text, chunks_num);
+		return ProcessStatQueries(text);
+	}
+
+	DataBase& ProcessFile(const char* path, const unsigned chunks_num = 1) {
+		const TextProtocol::MappedFile file(path);
+		return ProcessAll(file.View(), chunks_num);
+	}
+
+	// Writes the answer to one stat request; Route answers are streamed without building a JSON tree
+	void WriteStatQuery(const nlohmann::json& request, std::ostream& out) {
+		if(requestNames.at(request["type"]) == Request::Name::ROUTE) {
+			WriteRoute(request, out);
+		} else {
+			out << ProcessStatQuery(request);
+		}
+	}
+
+	// Capacity of this thread's itinerary buffer; it stays put once the longest route has been answered
+	static size_t RouteBufferCapacity() {
+		return RouteItems().capacity();
+	}
+
 	DataBase& ProcessJSON() {
 		nlohmann::json json_input;
 		input >> json_input;
 		FillDB(json_input);
-		output << ProcessStatQueries(json_input["stat_requests"]) << '\n';
+		output.put('[');
+		bool first = true;
+		for(auto& request: json_input["stat_requests"]) {
+			if(!std::exchange(first, false)) {
+				output.put(',');
+			}
+			WriteStatQuery(request, output);
+		}
+		output.write("]\n", 2);
 		return *this;
 	}
 
 private:
-	nlohmann::json BuildRoute(const nlohmann::json& request) {
-		auto& nameToOutStopID = graph->nameToOutStopID;
-		graph->router.BuildRoute(
-				nameToOutStopID.at((std::string) request["from"]),
-				nameToOutStopID.at((std::string) request["to"])
+	struct RouteItem {
+		enum class Type {
+			WAIT,
+			BUS
+		};
+
+		Type type;
+		// Stop name for Wait, bus name for Bus; both point into the graph
+		std::string_view name;
+		unsigned span_count;
+		double time;
+	};
+
+	// Itinerary buffer reused by every route answer on this thread
+	static std::vector<RouteItem>& RouteItems() {
+		static thread_local std::vector<RouteItem> items;
+		return items;
+	}
+
+	// Fills items in place, so a reused buffer stops allocating once it has grown to the longest route.
+	// Returns the total time, or nullopt if there is no route.
+	std::optional<double> BuildItinerary(const nlohmann::json& request, std::vector<RouteItem>& items) {
+		items.clear();
+		const auto& nameToOutStopID = graph->nameToOutStopID;
+		auto& router = graph->router;
+		const auto routeInfo = router.BuildRoute(
+				nameToOutStopID.at(request["from"].get_ref<const std::string&>()),
+				nameToOutStopID.at(request["to"].get_ref<const std::string&>())
 		);
-		return {}; // FIXME
+		if(!routeInfo) {
+			return std::nullopt;
+		}
+
+		// The path is a sequence of blocks: a wait edge (out stop -> in stop), ride edges (in stop -> in stop)
+		// and an alighting edge (in stop -> out stop), all of the same route.
+		for(size_t edge_idx = 0; edge_idx != routeInfo->edge_count;) {
+			const auto waitEdgeID = router.GetRouteEdge(routeInfo->id, edge_idx++);
+			const auto& waitEdge = graph->graph.GetEdge(waitEdgeID);
+			items.push_back({RouteItem::Type::WAIT, graph->OutStopName(waitEdge.from), 0, waitEdge.weight});
+
+			unsigned span_count = 0;
+			double time = 0;
+			for(;;) {
+				const auto& edge = graph->graph.GetEdge(router.GetRouteEdge(routeInfo->id, edge_idx++));
+				if(graph->IsOutStop(edge.to)) {
+					break;
+				}
+				++span_count;
+				time += edge.weight;
+			}
+			items.push_back({RouteItem::Type::BUS, graph->RouteName(waitEdgeID), span_count, time});
+		}
+		router.ReleaseRoute(routeInfo->id);
+		return routeInfo->weight;
+	}
+
+	struct ParsedChunk {
+		std::vector<StopInfo> stops;
+		std::vector<std::pair<std::string, RouteInfo>> routes;
+	};
+
+	static ParsedChunk ParseChunk(std::string_view chunk) {
+		ParsedChunk result;
+		while(!chunk.empty()) {
+			auto line = TextProtocol::ReadLine(chunk);
+			if(line.empty()) {
+				continue;
+			}
+			switch(ParseRequestName(line)) {
+				case Request::Name::BUS: {
+					const auto route_name = ParseRouteName(line, Request::RouteRequestType::NEW);
+					result.routes.emplace_back(route_name, ::ParseNewRoute(line));
+					break;
+				}
+				case Request::Name::STOP:
+					result.stops.push_back(::ParseNewStop(line));
+					break;
+				default:
+					break;
+			}
+		}
+		return result;
+	}
+
+	nlohmann::json FindNearestStops(const nlohmann::json& request) const {
+		// Read as signed: get<size_t>() would turn a negative count into a huge one
+		const auto requested_count = request["count"].get<int64_t>();
+		if(requested_count < 0) {
+			return {
+					{"request_id",    request["id"]},
+					{"error_message", "invalid count"}
+			};
+		}
+		const Coordinates target{request["latitude"], request["longitude"]};
+		const size_t count = std::min<size_t>(requested_count, stop_index.Size());
+		static thread_local std::vector<StopIndex::Neighbour> nearest_stops;
+		nearest_stops.reserve(count);
+		stop_index.FindNearest(target, count, nearest_stops);
+
+		auto stops = nlohmann::json::array();
+		for(auto& neighbour: nearest_stops) {
+			stops.push_back({
+					{"name",     stop_index.Name(neighbour)},
+					{"distance", target.CalcDist(stop_index.GetCoordinates(neighbour))}
+			});
+		}
+		return {
+				{"request_id", request["id"]},
+				{"stops",      std::move(stops)}
+		};
+	}
+
+	nlohmann::json BuildRoute(const nlohmann::json& request) {
+		auto& items = RouteItems();
+		const auto total_time = BuildItinerary(request, items);
+		if(!total_time) {
+			return {
+					{"request_id",    request["id"]},
+					{"error_message", "not found"}
+			};
+		}
+		auto items_json = nlohmann::json::array();
+		for(auto& item: items) {
+			if(item.type == RouteItem::Type::WAIT) {
+				items_json.push_back({{"type", "Wait"}, {"stop_name", item.name}, {"time", item.time}});
+			} else {
+				items_json.push_back({{"type", "Bus"}, {"bus", item.name}, {"span_count", item.span_count}, {"time", item.time}});
+			}
+		}
+		return {
+				{"request_id", request["id"]},
+				{"total_time", *total_time},
+				{"items",      std::move(items_json)}
+		};
+	}
+
+	// Same answer as BuildRoute, but the items go from a reused buffer straight into the stream
+	void WriteRoute(const nlohmann::json& request, std::ostream& out) {
+		using namespace JsonOutput;
+		auto& items = RouteItems();
+		const auto total_time = BuildItinerary(request, items);
+		if(!total_time) {
+			WriteRaw(out, R"({"error_message":"not found","request_id":)");
+			WriteNumber(out, request["id"].get<int64_t>());
+			out.put('}');
+			return;
+		}
+		WriteRaw(out, R"({"items":[)");
+		for(size_t i = 0; i != items.size(); ++i) {
+			const auto& item = items[i];
+			if(i != 0) {
+				out.put(',');
+			}
+			if(item.type == RouteItem::Type::WAIT) {
+				WriteRaw(out, R"({"stop_name":)");
+				WriteString(out, item.name);
+			} else {
+				WriteRaw(out, R"({"bus":)");
+				WriteString(out, item.name);
+				WriteRaw(out, R"(,"span_count":)");
+				WriteNumber(out, item.span_count);
+			}
+			WriteRaw(out, R"(,"time":)");
+			WriteNumber(out, item.time);
+			if(item.type == RouteItem::Type::WAIT) {
+				WriteRaw(out, R"(,"type":"Wait"})");
+			} else {
+				WriteRaw(out, R"(,"type":"Bus"})");
+			}
+		}
+		WriteRaw(out, R"(],"request_id":)");
+		WriteNumber(out, request["id"].get<int64_t>());
+		WriteRaw(out, R"(,"total_time":)");
+		WriteNumber(out, *total_time);
+		out.put('}');
 	}
 
 	void ProcessNewRoute(const std::string& routeName) {
@@ -739,8 +1403,6 @@ private:
 	}
 };
 
-unsigned DataBase::inStopsNum = 0;
-
 namespace Testing {
 	namespace Unit {
 		void ParseRequestName() {
@@ -880,11 +1542,125 @@ namespace Testing {
 			std::cerr << "\t\tParseNewBusStop test passed" << std::endl;
 		}
 
+		void ParseTextLines() {
+			{
+				std::string_view line = "Bus 750: Tolstopaltsevo - Marushkino - Rasskazovka\r";
+				line = TextProtocol::ReadLine(line);
+				ASSERT_EQUAL(::ParseRequestName(line), Request::Name::BUS)
+				ASSERT_EQUAL(::ParseRouteName(line, Request::RouteRequestType::NEW), "750")
+				ASSERT_EQUAL(
+						::ParseNewRoute(line),
+						(RouteInfo{RouteType::LOOPING, {"Tolstopaltsevo", "Marushkino", "Rasskazovka"}})
+				)
+			}
+			{
+				std::string_view line = "Bus 256: Biryulyovo Zapadnoye > Biryusinka > Biryulyovo Zapadnoye";
+				ASSERT_EQUAL(::ParseRequestName(line), Request::Name::BUS)
+				ASSERT_EQUAL(::ParseRouteName(line, Request::RouteRequestType::NEW), "256")
+				ASSERT_EQUAL(
+						::ParseNewRoute(line),
+						(RouteInfo{RouteType::CIRCULAR, {"Biryulyovo Zapadnoye", "Biryusinka", "Biryulyovo Zapadnoye"}})
+				)
+			}
+			{
+				std::string_view line = "Bus 13: Tolstopaltsevo";
+				ParseRouteName(line, Request::RouteRequestType::NEW);
+				bool thrown = false;
+				try {
+					::ParseNewRoute(line);
+				} catch(std::invalid_argument&) {
+					thrown = true;
+				}
+				ASSERT(thrown)
+			}
+			{
+				std::string_view line = "Bus gazZviu ncDtm";
+				ASSERT_EQUAL(::ParseRequestName(line), Request::Name::BUS)
+				ASSERT_EQUAL(::ParseRouteName(line, Request::RouteRequestType::EXISTING), "gazZviu ncDtm")
+			}
+			{
+				std::string_view line = "Stop Biryulyovo Passazhirskaya: 55.580999, 37.659164";
+				ASSERT_EQUAL(::ParseRequestName(line), Request::Name::STOP)
+				const auto stop_info = ::ParseNewStop(line);
+				ASSERT_EQUAL(stop_info, (StopInfo{"Biryulyovo Passazhirskaya", {55.580999, 37.659164}}))
+				ASSERT(stop_info.distances.empty())
+			}
+			{
+				std::string_view line = "Stop Universam: 55.587655, 37.645687, 5600m to Rossoshanskaya ulitsa, 900m to Biryulyovo Tovarnaya";
+				ASSERT_EQUAL(::ParseRequestName(line), Request::Name::STOP)
+				const auto stop_info = ::ParseNewStop(line);
+				ASSERT_EQUAL(stop_info, (StopInfo{"Universam", {55.587655, 37.645687}}))
+				ASSERT_EQUAL(
+						stop_info.distances,
+						(std::unordered_map<std::string, unsigned>{
+								{"Rossoshanskaya ulitsa", 5600},
+								{"Biryulyovo Tovarnaya",  900}
+						})
+				)
+			}
+			{
+				std::string_view text = "a\nb\nc\nd\ne\n";
+				ASSERT_EQUAL(TextProtocol::ReadLines(text, 2), "a\nb\n")
+				ASSERT_EQUAL(text, "c\nd\ne\n")
+				ASSERT_EQUAL(
+						TextProtocol::SplitIntoChunks(text, 2),
+						(std::vector<std::string_view>{"c\nd\n", "e\n"})
+				)
+				ASSERT_EQUAL(TextProtocol::SplitIntoChunks(text, 10).size(), 3u)
+				ASSERT_EQUAL(TextProtocol::SplitIntoChunks("c\nd", 1), (std::vector<std::string_view>{"c\nd"}))
+			}
+			std::cerr << "\t\tParseTextLines test passed" << std::endl;
+		}
+
+		void FindNearestStops() {
+			std::mt19937 rng(17);
+			std::uniform_real_distribution<double> latitude(55.5, 56.0), longitude(37.3, 37.9);
+			std::vector<std::string> names;
+			std::vector<std::pair<std::string_view, Coordinates>> stops;
+			for(unsigned i = 0; i != 500; ++i) {
+				names.push_back("Stop " + std::to_string(i));
+			}
+			for(auto& name: names) {
+				stops.emplace_back(name, Coordinates{latitude(rng), longitude(rng)});
+			}
+			const StopIndex index(stops);
+
+			std::vector<StopIndex::Neighbour> nearest;
+			for(unsigned query = 0; query != 200; ++query) {
+				const Coordinates target{latitude(rng), longitude(rng)};
+				const size_t count = query % 3 == 0 ? 1 : query % stops.size();
+				std::vector<std::pair<double, std::string_view>> expected;
+				for(auto &[name, coordinates]: stops) {
+					expected.emplace_back(target.CalcDist(coordinates), name);
+				}
+				std::sort(expected.begin(), expected.end());
+				expected.resize(count);
+
+				index.FindNearest(target, count, nearest);
+				std::vector<std::string_view> found;
+				for(auto& neighbour: nearest) {
+					found.push_back(index.Name(neighbour));
+				}
+				std::vector<std::string_view> expected_names;
+				for(auto& item: expected) {
+					expected_names.push_back(item.second);
+				}
+				ASSERT_EQUAL(found, expected_names)
+			}
+			index.FindNearest({55.7, 37.6}, 0, nearest);
+			ASSERT(nearest.empty())
+			StopIndex().FindNearest({55.7, 37.6}, 3, nearest);
+			ASSERT(nearest.empty())
+			std::cerr << "\t\tFindNearestStops test passed" << std::endl;
+		}
+
 		void TestAll() {
 			std::cerr << "\tUnit tests:" << std::endl;
 			ParseRequestName();
 			ParseRoute();
 			ParseNewBusStop();
+			ParseTextLines();
+			FindNearestStops();
 			std::cerr << "\tAll unit tests passed!" << std::endl;
 		}
 	}
@@ -990,7 +1766,6 @@ namespace Testing {
 
 			if constexpr (VERSION > 2 && VERSION < 5) {
 				{
-					DataBase::inStopsNum = 0;
 					std::istringstream input("13\n"
 											 "Stop Tolstopaltsevo: 55.611087, 37.20829, 3900m to Marushkino\n"
 											 "Stop Marushkino: 55.595884, 37.209755, 9900m to Rasskazovka\n"
@@ -1026,7 +1801,6 @@ namespace Testing {
 				}
 			}
 			if constexpr (VERSION == 4) {
-				DataBase::inStopsNum = 0;
 				std::istringstream input("{\n"
 										 "  \"base_requests\": [\n"
 										 "    {\n"
@@ -1194,9 +1968,218 @@ namespace Testing {
 			std::cerr << "\t\tTestDB passed" << std::endl;
 		}
 
+		const char* const sampleText =
+				"13\n"
+				"Stop Tolstopaltsevo: 55.611087, 37.20829, 3900m to Marushkino\n"
+				"Stop Marushkino: 55.595884, 37.209755, 9900m to Rasskazovka\n"
+				"Bus 256: Biryulyovo Zapadnoye > Biryusinka > Universam > Biryulyovo Tovarnaya > Biryulyovo Passazhirskaya > Biryulyovo Zapadnoye\n"
+				"Bus 750: Tolstopaltsevo - Marushkino - Rasskazovka\n"
+				"Stop Rasskazovka: 55.632761, 37.333324\n"
+				"Stop Biryulyovo Zapadnoye: 55.574371, 37.6517, 7500m to Rossoshanskaya ulitsa, 1800m to Biryusinka, 2400m to Universam\n"
+				"Stop Biryusinka: 55.581065, 37.64839, 750m to Universam\n"
+				"Stop Universam: 55.587655, 37.645687, 5600m to Rossoshanskaya ulitsa, 900m to Biryulyovo Tovarnaya\n"
+				"Stop Biryulyovo Tovarnaya: 55.592028, 37.653656, 1300m to Biryulyovo Passazhirskaya\n"
+				"Stop Biryulyovo Passazhirskaya: 55.580999, 37.659164, 1200m to Biryulyovo Zapadnoye\n"
+				"Bus 828: Biryulyovo Zapadnoye > Universam > Rossoshanskaya ulitsa > Biryulyovo Zapadnoye\n"
+				"Stop Rossoshanskaya ulitsa: 55.595579, 37.605757\n"
+				"Stop Prazhskaya: 55.611678, 37.603831\n"
+				"6\n"
+				"Bus 256\n"
+				"Bus 750\n"
+				"Bus 751\n"
+				"Stop Samara\n"
+				"Stop Prazhskaya\n"
+				"Stop Biryulyovo Zapadnoye";
+
+		const char* const sampleTextResponse =
+				"Bus 256: 6 stops on route, 5 unique stops, 5950 route length, 1.36124 curvature\n"
+				"Bus 750: 5 stops on route, 3 unique stops, 27600 route length, 1.31808 curvature\n"
+				"Bus 751: not found\n"
+				"Stop Samara: not found\n"
+				"Stop Prazhskaya: no buses\n"
+				"Stop Biryulyovo Zapadnoye: buses 256 828\n";
+
+		void TestTextIngestion() {
+			{
+				std::istringstream input(sampleText);
+				std::ostringstream output;
+				DataBase(input, output).ProcessAll();
+				ASSERT_EQUAL(output.str(), sampleTextResponse)
+			}
+			for(unsigned chunks_num : {1, 2, 5, 64}) {
+				std::istringstream input;
+				std::ostringstream output;
+				DataBase(input, output).ProcessAll(sampleText, chunks_num);
+				ASSERT_EQUAL(output.str(), sampleTextResponse)
+			}
+			{
+				char path[] = "/tmp/transport_XXXXXX";
+				const int fd = mkstemp(path);
+				ASSERT(fd != -1)
+				const std::string_view text = sampleText;
+				ASSERT_EQUAL(write(fd, text.data(), text.size()), static_cast<ssize_t>(text.size()))
+				close(fd);
+
+				std::istringstream input;
+				std::ostringstream output;
+				DataBase(input, output).ProcessFile(path, 4);
+				unlink(path);
+				ASSERT_EQUAL(output.str(), sampleTextResponse)
+			}
+			std::cerr << "\t\tTestTextIngestion passed" << std::endl;
+		}
+
+		const char* const sampleJSON = R"({
+  "routing_settings": {"bus_wait_time": 6, "bus_velocity": 40},
+  "base_requests": [
+    {"type": "Bus", "name": "297", "stops": ["Biryulyovo Zapadnoye", "Biryulyovo Tovarnaya", "Universam", "Biryulyovo Zapadnoye"], "is_roundtrip": true},
+    {"type": "Bus", "name": "635", "stops": ["Biryulyovo Tovarnaya", "Universam", "Prazhskaya"], "is_roundtrip": false},
+    {"type": "Stop", "name": "Biryulyovo Zapadnoye", "latitude": 55.574371, "longitude": 37.6517, "road_distances": {"Biryulyovo Tovarnaya": 2600}},
+    {"type": "Stop", "name": "Universam", "latitude": 55.587655, "longitude": 37.645687, "road_distances": {"Biryulyovo Tovarnaya": 1380, "Biryulyovo Zapadnoye": 2500, "Prazhskaya": 4650}},
+    {"type": "Stop", "name": "Biryulyovo Tovarnaya", "latitude": 55.592028, "longitude": 37.653656, "road_distances": {"Universam": 890}},
+    {"type": "Stop", "name": "Prazhskaya", "latitude": 55.611717, "longitude": 37.603938, "road_distances": {}},
+    {"type": "Stop", "name": "Rossoshanskaya ulitsa", "latitude": 55.595579, "longitude": 37.605757, "road_distances": {}}
+  ],
+  "stat_requests": [
+    {"type": "Bus", "name": "297", "id": 1},
+    {"type": "Bus", "name": "635", "id": 2},
+    {"type": "Stop", "name": "Universam", "id": 3},
+    {"type": "Route", "from": "Universam", "to": "Biryulyovo Zapadnoye", "id": 4},
+    {"type": "Route", "from": "Biryulyovo Tovarnaya", "to": "Prazhskaya", "id": 5},
+    {"type": "Route", "from": "Biryulyovo Zapadnoye", "to": "Biryulyovo Zapadnoye", "id": 6},
+    {"type": "Route", "from": "Biryulyovo Zapadnoye", "to": "Rossoshanskaya ulitsa", "id": 7}
+  ]
+})";
+
+		std::string ProcessSampleJSON() {
+			std::istringstream input(sampleJSON);
+			std::ostringstream output;
+			DataBase(input, output).ProcessJSON();
+			return output.str();
+		}
+
+		void TestRoute() {
+			if constexpr (VERSION == 5) {
+				ASSERT_EQUAL(
+						ProcessSampleJSON(),
+						"[{\"curvature\":1.4296268617644379,\"request_id\":1,\"route_length\":5990,\"stop_count\":4,\"unique_stop_count\":3},"
+						"{\"curvature\":1.3015604168998942,\"request_id\":2,\"route_length\":11570,\"stop_count\":5,\"unique_stop_count\":3},"
+						"{\"buses\":[\"297\",\"635\"],\"request_id\":3},"
+						"{\"items\":[{\"stop_name\":\"Universam\",\"time\":6.0,\"type\":\"Wait\"},"
+						"{\"bus\":\"297\",\"span_count\":1,\"time\":3.7499999999999996,\"type\":\"Bus\"}],\"request_id\":4,\"total_time\":9.75},"
+						"{\"items\":[{\"stop_name\":\"Biryulyovo Tovarnaya\",\"time\":6.0,\"type\":\"Wait\"},"
+						"{\"bus\":\"635\",\"span_count\":2,\"time\":8.309999999999999,\"type\":\"Bus\"}],\"request_id\":5,\"total_time\":14.309999999999999},"
+						"{\"items\":[],\"request_id\":6,\"total_time\":0.0},"
+						"{\"error_message\":\"not found\",\"request_id\":7}]\n"
+				)
+			}
+			std::cerr << "\t\tTestRoute passed" << std::endl;
+		}
+
+		void TestNearestStops() {
+			std::istringstream input;
+			std::ostringstream output;
+			DataBase db(input, output);
+			db.FillDB(nlohmann::json::parse(sampleJSON));
+			const auto response = db.ProcessStatQuery(
+					{{"type", "NearestStops"}, {"latitude", 55.587655}, {"longitude", 37.645687}, {"count", 3}, {"id", 8}}
+			);
+			ASSERT_EQUAL(response["request_id"], 8)
+			std::vector<std::string> names;
+			for(auto& stop: response["stops"]) {
+				names.push_back(stop["name"]);
+			}
+			ASSERT_EQUAL(names, (std::vector<std::string>{"Universam", "Biryulyovo Tovarnaya", "Biryulyovo Zapadnoye"}))
+			ASSERT_EQUAL(response["stops"][0]["distance"], 0.0)
+
+			const auto negative_count = db.ProcessStatQuery(
+					{{"type", "NearestStops"}, {"latitude", 55.587655}, {"longitude", 37.645687}, {"count", -1}, {"id", 9}}
+			);
+			ASSERT_EQUAL(negative_count["request_id"], 9)
+			ASSERT_EQUAL(negative_count["error_message"], "invalid count")
+			std::cerr << "\t\tTestNearestStops passed" << std::endl;
+		}
+
+		// Drops everything written to it without allocating
+		class NullBuffer : public std::streambuf {
+		protected:
+			int_type overflow(const int_type c) override {
+				return traits_type::not_eof(c);
+			}
+
+			std::streamsize xsputn(const char*, const std::streamsize n) override {
+				return n;
+			}
+		};
+
+		void TestRouteAllocations() {
+			// Stops S0..S6 in a line, bus Bi goes between Si and Si+1 only, so S0 -> Sk takes k buses
+			auto base_requests = nlohmann::json::array();
+			for(int i = 0; i != 7; ++i) {
+				auto distances = nlohmann::json::object();
+				if(i != 6) {
+					distances["S" + std::to_string(i + 1)] = 1000;
+					base_requests.push_back({
+							{"type", "Bus"}, {"name", "B" + std::to_string(i)},
+							{"stops", {"S" + std::to_string(i), "S" + std::to_string(i + 1)}}, {"is_roundtrip", false}
+					});
+				}
+				base_requests.push_back({
+						{"type", "Stop"}, {"name", "S" + std::to_string(i)}, {"latitude", 55.6 + i * 0.01},
+						{"longitude", 37.6}, {"road_distances", std::move(distances)}
+				});
+			}
+			std::istringstream input;
+			std::ostringstream output;
+			DataBase db(input, output);
+			db.FillDB({
+					{"routing_settings", {{"bus_wait_time", 6}, {"bus_velocity", 40}}},
+					{"base_requests",    std::move(base_requests)}
+			});
+
+			const nlohmann::json three_buses = {{"type", "Route"}, {"from", "S0"}, {"to", "S3"}, {"id", 1}};
+			const nlohmann::json five_buses = {{"type", "Route"}, {"from", "S0"}, {"to", "S5"}, {"id", 2}};
+			ASSERT_EQUAL(db.ProcessStatQuery(three_buses)["items"].size(), 6u)
+			ASSERT_EQUAL(db.ProcessStatQuery(five_buses)["items"].size(), 10u)
+
+			NullBuffer null_buffer;
+			std::ostream null_output(&null_buffer);
+			// The item buffer grows on the first long route only; later routes reuse it in place
+			db.WriteStatQuery(five_buses, null_output);
+			const size_t capacity = DataBase::RouteBufferCapacity();
+			ASSERT(capacity >= 10u)
+			for(unsigned i = 0; i != 3; ++i) {
+				db.WriteStatQuery(three_buses, null_output);
+				db.WriteStatQuery(five_buses, null_output);
+				ASSERT_EQUAL(DataBase::RouteBufferCapacity(), capacity)
+			}
+			std::cerr << "\t\tTestRouteAllocations passed" << std::endl;
+		}
+
+		void TestIndependentDBs() {
+			if constexpr (VERSION == 5) {
+				const auto expected = ProcessSampleJSON();
+				ASSERT_EQUAL(ProcessSampleJSON(), expected)
+
+				std::vector<std::future<std::string>> outputs;
+				for(unsigned i = 0; i != 4; ++i) {
+					outputs.push_back(std::async(std::launch::async, ProcessSampleJSON));
+				}
+				for(auto& output: outputs) {
+					ASSERT_EQUAL(output.get(), expected)
+				}
+			}
+			std::cerr << "\t\tTestIndependentDBs passed" << std::endl;
+		}
+
 		void TestAll() {
 			std::cerr << "\tIntegration tests:" << std::endl;
 			TestDB();
+			TestRoute();
+			TestRouteAllocations();
+			TestTextIngestion();
+			TestNearestStops();
+			TestIndependentDBs();
 			std::cerr << "\tAll integration tests passed!" << std::endl;
 		}
 	}
@@ -1280,6 +2263,7 @@ namespace Testing {
 //	}
 //};
 
+#ifndef TRANSPORT_BENCHMARK
 int main() {
 	Testing::TestAll();
 	DataBase(std::cin, std::cout).ProcessJSON();
@@ -1311,4 +2295,5 @@ int main() {
 //	w.DoSomething();
 
 	return 0;
-}
\ No newline at end of file
+}
+#endif